@@ -2,12 +2,19 @@
 
 #include "hnswlib.h"
 #include "visited_list_pool.h"
+#include <algorithm>
 #include <assert.h>
 #include <atomic>
+#include <errno.h>
+#include <fcntl.h>
 #include <fstream>
 #include <list>
 #include <random>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -84,19 +91,31 @@ public:
     }
   };
 
+  // One slot of the fixed-capacity candidate pool of searchBaseLayerPool.
+  struct PoolCandidate {
+    dist_t dist;
+    tableint id;
+    bool expanded;
+  };
+
   ~HierarchicalNSW() {
 
-    free(data_level0_memory_);
-    for (tableint i = 0; i < cur_element_count; i++) {
-      if (element_levels_[i] > 0)
-        free(linkLists_[i]);
+    freeLevel0();
+    // the link lists of a mapped index point into the mapping
+    if (mapped_base_ == nullptr) {
+      for (size_t i = 0; i < element_levels_.size(); i++) {
+        if (element_levels_[i] > 0)
+          free(linkLists_[i]);
+      }
     }
     free(linkLists_);
     delete visited_list_pool_;
+    if (mapped_base_ != nullptr)
+      munmap(mapped_base_, mapped_size_);
   }
 
   size_t max_elements_;
-  size_t cur_element_count;
+  size_t cur_element_count = 0;
   size_t size_data_per_element_;
   size_t size_links_per_element_;
 
@@ -108,7 +127,7 @@ public:
   double mult_, revSize_;
   int maxlevel_;
 
-  VisitedListPool *visited_list_pool_;
+  VisitedListPool *visited_list_pool_ = nullptr;
   std::mutex cur_element_count_guard_;
 
   std::vector<std::mutex> link_list_locks_;
@@ -123,14 +142,32 @@ public:
   size_t size_links_level0_;
   size_t offsetData_, offsetLevel0_;
 
-  char *data_level0_memory_;
-  char **linkLists_;
+  char *data_level0_memory_ = nullptr;
+  char **linkLists_ = nullptr;
   std::vector<int> element_levels_;
 
   size_t data_size_;
 
   bool has_deletions_;
 
+  // level 0 link lists moved out of data_level0_memory_ by compressLevel0:
+  // per element a varint of count << 1 | deleted, then the sorted neighbour
+  // ids as varint deltas, starting at links0_offset_[id]
+  bool compressed_level0_ = false;
+  std::vector<uint64_t> links0_offset_;
+  std::vector<uint8_t> links0_;
+
+  // file mapping of loadIndexMapped, the link lists of all levels point into
+  // it, and so does data_level0_memory_ while level0_mapped_
+  char *mapped_base_ = nullptr;
+  size_t mapped_size_ = 0;
+  bool level0_mapped_ = false;
+
+  // set by useHugePages, a level 0 arena on huge pages is an anonymous
+  // mapping of level0_huge_size_ bytes
+  HugePagePolicy huge_page_policy_ = HugePagePolicy::None;
+  size_t level0_huge_size_ = 0;
+
   size_t label_offset_;
   DISTFUNC<dist_t> fstdistfunc_;
   void *dist_func_param_;
@@ -308,32 +345,28 @@ public:
       candidate_set.pop();
 
       tableint current_node_id = current_node_pair.second;
-      int *data = (int *)get_linklist0(current_node_id);
-      size_t size = getListCount((linklistsizeint *)data);
-      //                bool cur_node_deleted =
-      //                isMarkedDeleted(current_node_id);
+      size_t size;
+      const tableint *datal = getNeighbors0(current_node_id, size);
       if (collect_metrics) {
         metric_hops++;
         metric_distance_computations += size;
       }
 
 #ifdef USE_SSE
-      _mm_prefetch((char *)(visited_array + *(data + 1)), _MM_HINT_T0);
-      _mm_prefetch((char *)(visited_array + *(data + 1) + 64), _MM_HINT_T0);
-      _mm_prefetch(data_level0_memory_ +
-                       (*(data + 1)) * size_data_per_element_ + offsetData_,
+      _mm_prefetch((char *)(visited_array + datal[0]), _MM_HINT_T0);
+      _mm_prefetch((char *)(visited_array + datal[0] + 64), _MM_HINT_T0);
+      _mm_prefetch(data_level0_memory_ + datal[0] * size_data_per_element_ +
+                       offsetData_,
                    _MM_HINT_T0);
-      _mm_prefetch((char *)(data + 2), _MM_HINT_T0);
+      _mm_prefetch((char *)(datal + 1), _MM_HINT_T0);
 #endif
 
-      for (size_t j = 1; j <= size; j++) {
-        int candidate_id = *(data + j);
-//                    if (candidate_id == 0) continue;
+      for (size_t j = 0; j < size; j++) {
+        int candidate_id = datal[j];
 #ifdef USE_SSE
-        _mm_prefetch((char *)(visited_array + *(data + j + 1)), _MM_HINT_T0);
+        _mm_prefetch((char *)(visited_array + datal[j + 1]), _MM_HINT_T0);
         _mm_prefetch(data_level0_memory_ +
-                         (*(data + j + 1)) * size_data_per_element_ +
-                         offsetData_,
+                         datal[j + 1] * size_data_per_element_ + offsetData_,
                      _MM_HINT_T0); ////////////
 #endif
         if (!(visited_array[candidate_id] == visited_array_tag)) {
@@ -346,11 +379,8 @@ public:
           if (top_candidates.size() < ef || lowerBound > dist) {
             candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-            _mm_prefetch(data_level0_memory_ +
-                             candidate_set.top().second *
-                                 size_data_per_element_ +
-                             offsetLevel0_, ///////////
-                         _MM_HINT_T0);      ////////////////////////
+            _mm_prefetch(getLinks0Address(candidate_set.top().second),
+                         _MM_HINT_T0);
 #endif
 
             if (!has_deletions || !isMarkedDeleted(candidate_id))
@@ -370,6 +400,117 @@ public:
     return top_candidates;
   }
 
+  // Same walk as searchBaseLayerST, but the candidates live in one array of
+  // at most ef slots kept sorted by distance, and the next node to expand is
+  // the closest slot not expanded yet. The array is thread local and only
+  // grows, so a query does no heap allocation. The search stops once all the
+  // slots are expanded. Deleted nodes keep their slot to route through and
+  // are dropped when the result is copied out. Returns the pool, its size is
+  // written to pool_size.
+  template <bool has_deletions, bool collect_metrics = false>
+  const PoolCandidate *searchBaseLayerPool(tableint ep_id,
+                                           const void *data_point, size_t ef,
+                                           size_t &pool_size) const {
+    static thread_local std::vector<PoolCandidate> pool;
+    if (pool.size() < ef + 1) {
+      pool.resize(ef + 1);
+    }
+    PoolCandidate *cands = pool.data();
+
+    VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+    vl_type *visited_array = vl->mass;
+    vl_type visited_array_tag = vl->curV;
+
+    cands[0] = {fstdistfunc_(data_point, getDataByInternalId(ep_id),
+                             dist_func_param_),
+                ep_id, false};
+    size_t size = 1;
+    visited_array[ep_id] = visited_array_tag;
+
+    size_t cursor = 0;
+    while (cursor < size) {
+      cands[cursor].expanded = true;
+      size_t list_size;
+      const tableint *datal = getNeighbors0(cands[cursor].id, list_size);
+      if (collect_metrics) {
+        metric_hops++;
+        metric_distance_computations += list_size;
+      }
+
+#ifdef USE_SSE
+      _mm_prefetch((char *)(visited_array + datal[0]), _MM_HINT_T0);
+      _mm_prefetch((char *)(visited_array + datal[0] + 64), _MM_HINT_T0);
+      _mm_prefetch(data_level0_memory_ + datal[0] * size_data_per_element_ +
+                       offsetData_,
+                   _MM_HINT_T0);
+      _mm_prefetch((char *)(datal + 1), _MM_HINT_T0);
+#endif
+
+      // lowest slot an insertion landed in, the next node to expand is
+      // there if it is before the cursor
+      size_t lowest = size;
+      for (size_t j = 0; j < list_size; j++) {
+        int candidate_id = datal[j];
+#ifdef USE_SSE
+        _mm_prefetch((char *)(visited_array + datal[j + 1]), _MM_HINT_T0);
+        _mm_prefetch(data_level0_memory_ +
+                         datal[j + 1] * size_data_per_element_ + offsetData_,
+                     _MM_HINT_T0);
+#endif
+        if (visited_array[candidate_id] == visited_array_tag) {
+          continue;
+        }
+        visited_array[candidate_id] = visited_array_tag;
+
+        dist_t dist = fstdistfunc_(
+            data_point, getDataByInternalId(candidate_id), dist_func_param_);
+        if (size == ef && dist >= cands[size - 1].dist) {
+          continue;
+        }
+
+        // binary search for the insert position, then shift the tail
+        size_t lo = 0, hi = size;
+        while (lo < hi) {
+          size_t mid = (lo + hi) / 2;
+          if (cands[mid].dist <= dist) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        memmove(cands + lo + 1, cands + lo,
+                (size - lo) * sizeof(PoolCandidate));
+        cands[lo] = {dist, (tableint)candidate_id, false};
+        if (size < ef) {
+          size++;
+        }
+        lowest = std::min(lowest, lo);
+      }
+
+      if (lowest <= cursor) {
+        cursor = lowest;
+      } else {
+        while (cursor < size && cands[cursor].expanded) {
+          cursor++;
+        }
+      }
+    }
+
+    visited_list_pool_->releaseVisitedList(vl);
+
+    if (has_deletions) {
+      size_t live = 0;
+      for (size_t i = 0; i < size; i++) {
+        if (!isMarkedDeleted(cands[i].id)) {
+          cands[live++] = cands[i];
+        }
+      }
+      size = live;
+    }
+    pool_size = size;
+    return cands;
+  }
+
   std::vector<std::pair<dist_t, labeltype>> getNeighboursWithinRadius(
       std::priority_queue<std::pair<dist_t, tableint>,
                           std::vector<std::pair<dist_t, tableint>>,
@@ -397,25 +538,24 @@ public:
       radius_queue.pop();
 
       tableint current_id = cur.second;
-      int *data = (int *)get_linklist0(current_id);
-      size_t size = getListCount((linklistsizeint *)data);
+      size_t size;
+      const tableint *datal = getNeighbors0(current_id, size);
 
 #ifdef USE_SSE
-      _mm_prefetch((char *)(visited_array + *(data + 1)), _MM_HINT_T0);
-      _mm_prefetch((char *)(visited_array + *(data + 1) + 64), _MM_HINT_T0);
-      _mm_prefetch(data_level0_memory_ +
-                       (*(data + 1)) * size_data_per_element_ + offsetData_,
+      _mm_prefetch((char *)(visited_array + datal[0]), _MM_HINT_T0);
+      _mm_prefetch((char *)(visited_array + datal[0] + 64), _MM_HINT_T0);
+      _mm_prefetch(data_level0_memory_ + datal[0] * size_data_per_element_ +
+                       offsetData_,
                    _MM_HINT_T0);
-      _mm_prefetch((char *)(data + 2), _MM_HINT_T0);
+      _mm_prefetch((char *)(datal + 1), _MM_HINT_T0);
 #endif
-      for (size_t j = 1; j <= size; j++) {
-        int candidate_id = *(data + j);
+      for (size_t j = 0; j < size; j++) {
+        int candidate_id = datal[j];
 
 #ifdef USE_SSE
-        _mm_prefetch((char *)(visited_array + *(data + j + 1)), _MM_HINT_T0);
+        _mm_prefetch((char *)(visited_array + datal[j + 1]), _MM_HINT_T0);
         _mm_prefetch(data_level0_memory_ +
-                         (*(data + j + 1)) * size_data_per_element_ +
-                         offsetData_,
+                         datal[j + 1] * size_data_per_element_ + offsetData_,
                      _MM_HINT_T0); ////////////
 #endif
         if (!(visited_array[candidate_id] == visited_array_tag)) {
@@ -610,6 +750,179 @@ public:
                       : get_linklist(internal_id, level);
   };
 
+  static inline const uint8_t *readVarint(const uint8_t *p, uint32_t &v) {
+    v = *p & 0x7f;
+    for (int shift = 7; *p++ & 0x80; shift += 7) {
+      v |= (uint32_t)(*p & 0x7f) << shift;
+    }
+    return p;
+  }
+
+  static inline void writeVarint(std::vector<uint8_t> &out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+  }
+
+  // address of the level 0 links of an element, to prefetch
+  const char *getLinks0Address(tableint internal_id) const {
+    return compressed_level0_
+               ? (const char *)links0_.data() + links0_offset_[internal_id]
+               : (const char *)get_linklist0(internal_id);
+  }
+
+  // level 0 neighbours of an element and their number. A compressed list is
+  // decoded into a thread local buffer that stays valid until the next call
+  // on the same thread.
+  const tableint *getNeighbors0(tableint internal_id, size_t &size) const {
+    if (!compressed_level0_) {
+      linklistsizeint *ll = get_linklist0(internal_id);
+      size = getListCount(ll);
+      return (tableint *)(ll + 1);
+    }
+    static thread_local std::vector<tableint> neighbors;
+    // one slot more, the search loops prefetch one past the last neighbour
+    if (neighbors.size() < maxM0_ + 1) {
+      neighbors.resize(maxM0_ + 1);
+    }
+    uint32_t head, id = 0, delta;
+    const uint8_t *p =
+        readVarint(links0_.data() + links0_offset_[internal_id], head);
+    size = head >> 1;
+    for (size_t j = 0; j < size; j++) {
+      p = readVarint(p, delta);
+      id += delta;
+      neighbors[j] = id;
+    }
+    neighbors[size] = size > 0 ? neighbors[0] : internal_id;
+    return neighbors.data();
+  }
+
+  // release the level 0 arena however it was allocated
+  void freeLevel0() {
+    if (level0_mapped_) {
+      // part of the file mapping
+    } else if (level0_huge_size_ > 0) {
+      freeHugePages(data_level0_memory_, level0_huge_size_);
+    } else {
+      free(data_level0_memory_);
+    }
+    data_level0_memory_ = nullptr;
+    level0_mapped_ = false;
+    level0_huge_size_ = 0;
+  }
+
+  // Back the level 0 arena and the visited lists as the policy asks, then
+  // report how much of them the kernel actually put on huge pages, it may
+  // hand out fewer than asked for. An arena mapped from the index file is
+  // only advised, so that it stays shared. Call it before searching; the
+  // arena goes back to malloc if compressLevel0, reorderGraph or resizeIndex
+  // reallocate it. Returns the bytes of the arena on huge pages.
+  size_t useHugePages(HugePagePolicy policy) {
+    huge_page_policy_ = policy;
+    delete visited_list_pool_;
+    visited_list_pool_ = new VisitedListPool(1, max_elements_, policy);
+
+    size_t bytes = max_elements_ * size_data_per_element_;
+    if (level0_mapped_) {
+      // the kernel may not support huge pages for file mappings, the search
+      // works all the same without them
+      if (madvise(mapped_base_, mapped_size_,
+                  policy == HugePagePolicy::None ? MADV_NOHUGEPAGE
+                                                 : MADV_HUGEPAGE) != 0)
+        std::cout << "hnsw huge pages: madvise of the index mapping failed, "
+                  << "errno: " << errno << ", error: " << strerror(errno)
+                  << std::endl;
+    } else if (policy != HugePagePolicy::None || level0_huge_size_ > 0) {
+      size_t huge_size;
+      char *arena = (char *)allocHugePages(bytes, policy, &huge_size);
+      if (arena == nullptr)
+        throw std::runtime_error(
+            "Not enough memory: useHugePages failed to allocate level0");
+      memcpy(arena, data_level0_memory_,
+             cur_element_count * size_data_per_element_);
+      freeLevel0();
+      data_level0_memory_ = arena;
+      level0_huge_size_ = huge_size;
+    }
+
+    // the mappings are rounded up to whole huge pages
+    size_t level0_huge = std::min(bytes, hugePageBytes(data_level0_memory_));
+    VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+    size_t visited_huge =
+        std::min(max_elements_ * sizeof(vl_type), hugePageBytes(vl->mass));
+    visited_list_pool_->releaseVisitedList(vl);
+    std::cout << "hnsw huge pages, policy " << (int)policy << ": level 0 "
+              << level0_huge << " of " << bytes << " bytes, visited list "
+              << visited_huge << " of " << max_elements_ * sizeof(vl_type)
+              << " bytes" << std::endl;
+    return level0_huge;
+  }
+
+  void checkWritable() const {
+    if (compressed_level0_)
+      throw std::runtime_error("the level 0 links are compressed, the graph "
+                               "is read only");
+    if (mapped_base_ != nullptr)
+      throw std::runtime_error("the index is mapped from its file, the graph "
+                               "is read only");
+  }
+
+  // Move the level 0 link lists out of the element arena into a compressed
+  // stream, sorted and delta encoded as varints, and shrink the arena to the
+  // vectors and labels. Ids renumbered by reorderGraph give small deltas.
+  // The graph is read only afterwards: adding, deleting, reordering and
+  // saving are refused.
+  void compressLevel0() {
+    if (compressed_level0_)
+      return;
+    links0_offset_.resize(cur_element_count + 1);
+    links0_.clear();
+    std::vector<tableint> sorted;
+    for (tableint i = 0; i < cur_element_count; i++) {
+      linklistsizeint *ll = get_linklist0(i);
+      size_t size = getListCount(ll);
+      tableint *datal = (tableint *)(ll + 1);
+      sorted.assign(datal, datal + size);
+      std::sort(sorted.begin(), sorted.end());
+      links0_offset_[i] = links0_.size();
+      writeVarint(links0_, (uint32_t)(size << 1 | isMarkedDeleted(i)));
+      tableint prev = 0;
+      for (auto id : sorted) {
+        writeVarint(links0_, id - prev);
+        prev = id;
+      }
+    }
+    links0_offset_[cur_element_count] = links0_.size();
+    links0_.shrink_to_fit();
+
+    size_t new_size_per_element = data_size_ + sizeof(labeltype);
+    char *new_level0 = (char *)malloc(max_elements_ * new_size_per_element);
+    if (new_level0 == nullptr)
+      throw std::runtime_error("Not enough memory: compressLevel0 failed to "
+                               "allocate level0");
+    for (tableint i = 0; i < cur_element_count; i++) {
+      memcpy(new_level0 + i * new_size_per_element, getDataByInternalId(i),
+             data_size_);
+      memcpy(new_level0 + i * new_size_per_element + data_size_,
+             data_level0_memory_ + i * size_data_per_element_ + label_offset_,
+             sizeof(labeltype));
+    }
+    std::cout << "compress hnsw level 0 links of " << cur_element_count
+              << " elements from "
+              << cur_element_count * size_links_level0_ << " to "
+              << links0_.size() + links0_offset_.size() * sizeof(uint64_t)
+              << " bytes" << std::endl;
+    freeLevel0();
+    data_level0_memory_ = new_level0;
+    size_data_per_element_ = new_size_per_element;
+    offsetData_ = 0;
+    label_offset_ = data_size_;
+    compressed_level0_ = true;
+  }
+
   tableint mutuallyConnectNewElement(
       const void *data_point, tableint cur_c,
       std::priority_queue<std::pair<dist_t, tableint>,
@@ -791,12 +1104,14 @@ public:
   };
 
   void resizeIndex(size_t new_max_elements) {
+    checkWritable();
     if (new_max_elements < cur_element_count)
       throw std::runtime_error("Cannot resize, max element is less than the "
                                "current number of elements");
 
     delete visited_list_pool_;
-    visited_list_pool_ = new VisitedListPool(1, new_max_elements);
+    visited_list_pool_ =
+        new VisitedListPool(1, new_max_elements, huge_page_policy_);
 
     element_levels_.resize(new_max_elements);
 
@@ -810,7 +1125,7 @@ public:
           "Not enough memory: resizeIndex failed to allocate base layer");
     memcpy(data_level0_memory_new, data_level0_memory_,
            cur_element_count * size_data_per_element_);
-    free(data_level0_memory_);
+    freeLevel0();
     data_level0_memory_ = data_level0_memory_new;
 
     // Reallocate all other layers
@@ -825,7 +1140,83 @@ public:
     max_elements_ = new_max_elements;
   }
 
+  // Renumber the internal ids in breadth-first order of the level 0 graph
+  // from the entry point, so that the neighbours of a node sit in nearby
+  // cache lines and pages of data_level0_memory_. Nodes the walk does not
+  // reach keep their relative order at the end. The elements and their upper
+  // level lists are moved and every link is rewritten. Meant to be called
+  // once the graph is built, before saveIndex; not thread safe.
+  void reorderGraph() {
+    checkWritable();
+    if (cur_element_count == 0)
+      return;
+
+    std::vector<tableint> order;
+    order.reserve(cur_element_count);
+    std::vector<char> seen(cur_element_count, 0);
+    auto bfs = [&](tableint start) {
+      size_t head = order.size();
+      order.push_back(start);
+      seen[start] = 1;
+      while (head < order.size()) {
+        linklistsizeint *ll = get_linklist0(order[head++]);
+        size_t size = getListCount(ll);
+        tableint *datal = (tableint *)(ll + 1);
+        for (size_t j = 0; j < size; j++) {
+          if (!seen[datal[j]]) {
+            seen[datal[j]] = 1;
+            order.push_back(datal[j]);
+          }
+        }
+      }
+    };
+    bfs(enterpoint_node_);
+    for (tableint i = 0; i < cur_element_count; i++) {
+      if (!seen[i]) {
+        bfs(i);
+      }
+    }
+
+    std::vector<tableint> new_id(cur_element_count);
+    for (tableint i = 0; i < cur_element_count; i++) {
+      new_id[order[i]] = i;
+    }
+
+    char *new_level0 = (char *)malloc(max_elements_ * size_data_per_element_);
+    if (new_level0 == nullptr)
+      throw std::runtime_error("Not enough memory: reorderGraph failed to "
+                               "allocate level0");
+    std::vector<char *> new_link_lists(cur_element_count);
+    std::vector<int> new_levels(cur_element_count);
+    for (tableint i = 0; i < cur_element_count; i++) {
+      tableint old_id = order[i];
+      memcpy(new_level0 + i * size_data_per_element_,
+             data_level0_memory_ + old_id * size_data_per_element_,
+             size_data_per_element_);
+      new_link_lists[i] = linkLists_[old_id];
+      new_levels[i] = element_levels_[old_id];
+    }
+    freeLevel0();
+    data_level0_memory_ = new_level0;
+    std::copy(new_link_lists.begin(), new_link_lists.end(), linkLists_);
+    std::copy(new_levels.begin(), new_levels.end(), element_levels_.begin());
+
+    for (tableint i = 0; i < cur_element_count; i++) {
+      for (int level = 0; level <= element_levels_[i]; level++) {
+        linklistsizeint *ll = get_linklist_at_level(i, level);
+        size_t size = getListCount(ll);
+        tableint *datal = (tableint *)(ll + 1);
+        for (size_t j = 0; j < size; j++) {
+          datal[j] = new_id[datal[j]];
+        }
+      }
+      label_lookup_[getExternalLabel(i)] = i;
+    }
+    enterpoint_node_ = new_id[enterpoint_node_];
+  }
+
   void saveIndex(const std::string &location) {
+    checkWritable();
     std::ofstream output(location, std::ios::binary);
     std::streampos position;
 
@@ -975,6 +1366,107 @@ public:
     return;
   }
 
+  // Load an index saved by saveIndex without copying it: the file is mapped
+  // read only and shared, data_level0_memory_ and the upper level link lists
+  // point into the mapping, so processes serving the same file share its
+  // page cache pages and a restart only scans the upper level size records.
+  // The graph is read only. The label lookup and the update locks are not
+  // built, and has_deletions_ is assumed rather than scanned for, which only
+  // costs a filter over the final candidates.
+  void loadIndexMapped(const std::string &location,
+                       SpaceInterface<dist_t> *s) {
+    int fd = open(location.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Cannot open file");
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("Cannot stat file");
+    }
+    mapped_size_ = st.st_size;
+    void *addr = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      throw std::runtime_error("Cannot map file");
+    mapped_base_ = (char *)addr;
+    // graph hops are random accesses, no read-ahead
+    madvise(mapped_base_, mapped_size_, MADV_RANDOM);
+
+    // a half loaded index is left empty, the mapping is released with it
+    try {
+      parseMapped(s);
+    } catch (...) {
+      cur_element_count = 0;
+      element_levels_.clear();
+      throw;
+    }
+  }
+
+  // Point the index into the file mapped at mapped_base_, checking every
+  // record against the end of the mapping.
+  void parseMapped(SpaceInterface<dist_t> *s) {
+    const char *pos = mapped_base_;
+    const char *end = mapped_base_ + mapped_size_;
+    auto read_pod = [&](auto &value) {
+      if (sizeof(value) > (size_t)(end - pos))
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+      memcpy(&value, pos, sizeof(value));
+      pos += sizeof(value);
+    };
+    read_pod(offsetLevel0_);
+    read_pod(max_elements_);
+    read_pod(cur_element_count);
+    max_elements_ = cur_element_count;
+    read_pod(size_data_per_element_);
+    read_pod(label_offset_);
+    read_pod(offsetData_);
+    read_pod(maxlevel_);
+    read_pod(enterpoint_node_);
+    read_pod(maxM_);
+    read_pod(maxM0_);
+    read_pod(M_);
+    read_pod(mult_);
+    read_pod(ef_construction_);
+
+    data_size_ = s->get_data_size();
+    fstdistfunc_ = s->get_dist_func();
+    dist_func_param_ = s->get_dist_func_param();
+
+    if (size_data_per_element_ == 0 ||
+        cur_element_count > (size_t)(end - pos) / size_data_per_element_)
+      throw std::runtime_error("Index seems to be corrupted or unsupported");
+    data_level0_memory_ = (char *)pos;
+    level0_mapped_ = true;
+    pos += cur_element_count * size_data_per_element_;
+
+    size_links_per_element_ =
+        maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+    size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+
+    visited_list_pool_ = new VisitedListPool(1, cur_element_count);
+
+    linkLists_ = (char **)malloc(sizeof(void *) * cur_element_count);
+    if (linkLists_ == nullptr)
+      throw std::runtime_error(
+          "Not enough memory: loadIndexMapped failed to allocate linklists");
+    element_levels_ = std::vector<int>(cur_element_count);
+    revSize_ = 1.0 / mult_;
+    ef_ = 10;
+    for (size_t i = 0; i < cur_element_count; i++) {
+      unsigned int linkListSize;
+      read_pod(linkListSize);
+      if (linkListSize > (size_t)(end - pos))
+        throw std::runtime_error("Index seems to be corrupted or unsupported");
+      element_levels_[i] = linkListSize / size_links_per_element_;
+      linkLists_[i] = linkListSize == 0 ? nullptr : (char *)pos;
+      pos += linkListSize;
+    }
+    if (pos != end)
+      throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+    has_deletions_ = true;
+  }
+
   template <typename data_t>
   std::vector<data_t> getDataByLabel(labeltype label) {
     tableint label_c;
@@ -1018,6 +1510,7 @@ public:
    * @param internalId
    */
   void markDeletedInternal(tableint internalId) {
+    checkWritable();
     unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
     *ll_cur |= DELETE_MARK;
   }
@@ -1027,6 +1520,7 @@ public:
    * @param internalId
    */
   void unmarkDeletedInternal(tableint internalId) {
+    checkWritable();
     unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
     *ll_cur &= ~DELETE_MARK;
   }
@@ -1038,6 +1532,8 @@ public:
    * @return
    */
   bool isMarkedDeleted(tableint internalId) const {
+    if (compressed_level0_)
+      return links0_[links0_offset_[internalId]] & 1;
     unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
     return *ll_cur & DELETE_MARK;
   }
@@ -1236,6 +1732,7 @@ public:
   };
 
   tableint addPoint(const void *data_point, labeltype label, int level) {
+    checkWritable();
 
     tableint cur_c = 0;
     {
@@ -1426,6 +1923,64 @@ public:
     return result;
   };
 
+  // The k nearest labels, sorted by distance, written to distances and
+  // labels. Returns how many were found, at most k. Built on
+  // searchBaseLayerPool, so it does not allocate per query.
+  size_t searchKnn(const void *query_data, size_t k, dist_t *distances,
+                   labeltype *labels) const {
+    if (cur_element_count == 0)
+      return 0;
+
+    tableint currObj = enterpoint_node_;
+    dist_t curdist = fstdistfunc_(
+        query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+
+    for (int level = maxlevel_; level > 0; level--) {
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        unsigned int *data;
+
+        data = (unsigned int *)get_linklist(currObj, level);
+        int size = getListCount(data);
+        metric_hops++;
+        metric_distance_computations += size;
+
+        tableint *datal = (tableint *)(data + 1);
+        for (int i = 0; i < size; i++) {
+          tableint cand = datal[i];
+          if (cand < 0 || cand > max_elements_)
+            throw std::runtime_error("cand error");
+          dist_t d = fstdistfunc_(query_data, getDataByInternalId(cand),
+                                  dist_func_param_);
+
+          if (d < curdist) {
+            curdist = d;
+            currObj = cand;
+            changed = true;
+          }
+        }
+      }
+    }
+
+    size_t pool_size;
+    const PoolCandidate *cands;
+    if (has_deletions_) {
+      cands = searchBaseLayerPool<true, true>(currObj, query_data,
+                                              std::max(ef_, k), pool_size);
+    } else {
+      cands = searchBaseLayerPool<false, true>(currObj, query_data,
+                                               std::max(ef_, k), pool_size);
+    }
+
+    size_t n = std::min(k, pool_size);
+    for (size_t i = 0; i < n; i++) {
+      distances[i] = cands[i].dist;
+      labels[i] = getExternalLabel(cands[i].id);
+    }
+    return n;
+  }
+
   std::vector<std::pair<dist_t, labeltype>>
   searchRange(const void *query_data, size_t k, float radius) const {
     if (cur_element_count == 0)
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <list>
+#include <map>
 #include <memory>
 #include <string>
 #include <thread>
@@ -15,6 +16,9 @@
 #include "util/defines.h"
 
 namespace bbann {
+class BuildManifest;
+class DeletionBitmap;
+
 std::string Hello();
 
 template <typename DATAT, typename DISTT>
@@ -41,8 +45,35 @@ template <typename T>
 void reservoir_sampling(const std::string &data_file, const size_t sample_num,
                         T *sample_data);
 
+template <typename T>
+void random_access_sampling(const std::string &data_file,
+                            const size_t sample_num, T *sample_data);
+
 template <typename DATAT, typename DISTT>
-void hierarchical_clusters(const BBAnnParameters para, const double avg_len);
+void hierarchical_clusters(const BBAnnParameters para, const double avg_len,
+                           BuildManifest *manifest = nullptr);
+
+// concatenate the bucket files written by the shards of a sharded build
+template <typename DATAT>
+void merge_bucket_shards(const BBAnnParameters para);
+
+// rewrite the blocks of one K1 cluster into out_file for compaction, one
+// block at a time. entries of deleted ids are dropped and the rows of
+// data/ids placed in a bucket (bid -> rows) are appended to it. a bucket that
+// overflows its block is split with same size k-means, the parts after the
+// first get the block ids following the existing blocks. the global block id
+// and centroid of every changed bucket are appended to bucket_centroids, the
+// global block id of every bucket left empty to emptied_buckets. the ids in
+// the new blocks are written to ids_out_file as the global ids file of the
+// cluster. returns false, without leaving out_file, if no bucket changed.
+template <typename DATAT>
+bool compact_cluster(
+    const BBAnnParameters para, const uint32_t cid, const uint32_t dim,
+    const DeletionBitmap *deleted, const DATAT *data, const uint32_t *ids,
+    const std::map<uint32_t, std::vector<uint64_t>> &placed,
+    const std::string &out_file, const std::string &ids_out_file,
+    std::vector<std::pair<uint32_t, std::vector<DATAT>>> &bucket_centroids,
+    std::vector<uint32_t> &emptied_buckets);
 
 template <typename DATAT, typename DISTT>
 void build_graph(const std::string &index_path, const int hnswM,
@@ -3,11 +3,17 @@
 
 #include "hnswlib/hnswalg.h"
 #include "lib/algo.h"
+#include "lib/delta_index.h"
+#include "util/cluster_map.h"
+#include "util/deletion_bitmap.h"
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <stdint.h>
 #include <string>
 #include <tuple>
+#include <vector>
 
 namespace bbann {
 
@@ -37,12 +43,51 @@ public:
              std::vector<uint64_t>>
   RangeSearchCpp(const dataT *pquery, uint64_t dim, uint64_t numQuery,
                  double radius, const BBAnnParameters para) override;
+
+  // add n vectors with the given ids to the loaded index. they are searchable
+  // right away and persisted in the delta write-ahead file.
+  void Insert(const dataT *data, const uint32_t *ids, uint64_t n);
+
+  // hide the vectors with the given ids from all searches. the tombstones
+  // are persisted in the deleted ids file.
+  void Delete(const uint32_t *ids, uint64_t n);
+
+  // move the inserted vectors into the blocks of their nearest buckets and
+  // drop the entries of deleted ids. searches, inserts and deletes keep
+  // running, they only wait while the compacted files are swapped in.
+  // returns false if the index can not be compacted.
+  bool Compact(const BBAnnParameters para);
+
   std::shared_ptr<hnswlib::HierarchicalNSW<distanceT>> index_hnsw_;
   std::shared_ptr<sq_hnswlib::HierarchicalNSW<float>> index_sq_hnsw_;
+  std::shared_ptr<DeltaIndex<dataT, distanceT>> delta_;
+  std::shared_ptr<DeletionBitmap> deleted_;
+
+  // the cluster of every id in the blocks and the deletions per cluster that
+  // are not compacted yet, so a compaction only rewrites the clusters they
+  // hit. built from the global ids files on the first deletion. a cluster
+  // without the file is rewritten by every compaction with deletions.
+  std::unique_ptr<ClusterMap> cluster_map_;
+  std::vector<uint64_t> cluster_deleted_;
+  std::vector<bool> cluster_unmapped_;
+  // held by deletes and by the compaction while it reads or updates the
+  // cluster map, serializes the deletions with their counting
+  std::mutex cluster_mutex_;
+  uint32_t K1_ = 0;
+
+  // held shared by searches, inserts and deletes, and exclusively by the
+  // compaction while it swaps in its files
+  std::shared_mutex swap_mutex_;
+  // one compaction at a time
+  std::mutex compact_mutex_;
 
   std::string indexPrefix_;
   std::string dataFilePath_;
 
+  // build the cluster map and count the logged deletions per cluster, with
+  // cluster_mutex_ held. does nothing once the map is built.
+  void MapClusters();
+
   static void BuildIndexImpl(const BBAnnParameters para);
   void BuildWithParameter(const BBAnnParameters para);
 
@@ -54,6 +99,9 @@ public:
     return indexPrefix_ + "cluster-" + std::to_string(cluster_id) +
            "-raw_data.bin";
   }
+  std::string getBucketCentroidsIdsFileName() {
+    return indexPrefix_ + "cluster-combine_ids.bin";
+  }
   std::string getClusterGlobalIdsFileName(int cluster_id) {
     return indexPrefix_ + "cluster-" + std::to_string(cluster_id) +
            "-global_ids.bin";
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "util/deletion_bitmap.h"
+#include "util/defines.h"
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace bbann {
+
+// Vectors inserted into a built index, kept in RAM until compaction moves
+// them into the block files. The delta is a flat buffer scanned exhaustively
+// on every query. Each Insert is appended to a write-ahead file before it
+// becomes visible, so the delta survives a restart. Insert and the searches
+// may run concurrently.
+template <typename dataT, typename distanceT> class DeltaIndex {
+public:
+  DeltaIndex(MetricType metric, uint32_t dim) : metric_(metric), dim_(dim) {}
+  ~DeltaIndex();
+
+  // replay the write-ahead file if it exists, the following inserts are
+  // appended to it. a torn record at the tail is truncated.
+  void Open(const std::string &wal_file);
+
+  void Insert(const dataT *data, const uint32_t *ids, uint64_t n);
+
+  // top-knn of every query, sorted best first and padded with the heap's
+  // neutral value and id -1, the layout expected by merge(). ids set in
+  // deleted are skipped.
+  void Search(const dataT *pquery, uint64_t nq, uint64_t knn,
+              uint32_t *answer_ids, distanceT *answer_dists,
+              const DeletionBitmap *deleted = nullptr);
+
+  // appends <qid, id, dist> of every vector closer than radius
+  void RangeSearch(const dataT *pquery, uint64_t nq, double radius,
+                   std::vector<std::tuple<uint32_t, uint32_t, distanceT>> &ans,
+                   const DeletionBitmap *deleted = nullptr);
+
+  uint32_t dim() const { return dim_; }
+
+  uint64_t size() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return ids_.size();
+  }
+
+  // copy out the vectors inserted so far, returns their number
+  uint64_t Snapshot(std::vector<dataT> &data, std::vector<uint32_t> &ids);
+
+  // write the vectors from position `from` on as a write-ahead file
+  void WriteWal(uint64_t from, const std::string &file);
+
+  // drop the first n vectors once compaction has moved them into the blocks.
+  // the write-ahead file has been replaced by then, it is reopened by the
+  // next Insert.
+  void Truncate(uint64_t n);
+
+private:
+  MetricType metric_;
+  uint32_t dim_;
+  std::vector<dataT> data_;
+  std::vector<uint32_t> ids_;
+  std::string wal_file_;
+  int wal_fd_ = -1;
+  std::shared_mutex mutex_;
+};
+
+} // namespace bbann
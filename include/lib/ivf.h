@@ -2,10 +2,10 @@
 #include "util/file_handler.h"
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <memory>
-#include <mutex>
 #include <string.h>
 #include <unistd.h>
 #include <vector>
@@ -22,10 +22,20 @@ template <typename T1, typename T2, typename R>
 void elkan_L2_assign(const T1 *x, const T2 *y, int64_t dim, int64_t nx,
                      int64_t ny, int64_t *ids, R *val);
 
+// the nearest centroid up to float rounding, found with ||x||^2 - 2 x.y +
+// ||y||^2 by a cache blocked inner product kernel. centroids closer than the
+// rounding error may be picked in place of the one elkan_L2_assign picks, val
+// is the distance to the picked one, computed directly.
+template <typename T1, typename R>
+void blocked_L2_assign(const T1 *x, const float *y, int64_t dim, int64_t nx,
+                       int64_t ny, int64_t *ids, R *val);
+
+// bounded: points whose Hamerly bounds show they keep their centroid are
+// not rescanned. false rescans every point every iteration, same result.
 template <typename T>
 void kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k, float *centroids,
             bool kmpp = false, float avg_len = 0.0, int64_t niter = 10,
-            int64_t seed = 1234);
+            int64_t seed = 1234, bool bounded = true);
 
 template <typename T>
 void non_recursive_multilevel_kmeans(
@@ -38,15 +48,14 @@ void non_recursive_multilevel_kmeans(
     uint32_t threshold,      // determines when to stop recursive clustering
     const uint64_t blk_size, // general 4096, determines how many vectors can be
                              // placed in a block
-    uint32_t
-        &blk_num, // output variable, num block output in this round clustering
-    IOWriter &data_writer,         // file writer 1: to output base vectors
-    IOWriter &centroids_writer,    // file writer 2: to output centroid vectors
-    IOWriter &centroids_id_writer, // file writer 3: to output centroid ids
-    int64_t
-        centroids_id_start_position, // the start position of all centroids id
-    int level,         // n-th round recursive clustering, start with 0
-    std::mutex &mutex, // mutex to protect write out centroids
+    std::atomic<uint32_t> &blk_num, // in/out: num blocks reserved for this
+                                    // K1 cluster, a block takes the next index
+    PositionalWriter &data_writer,  // file writer 1: to output base vectors
+    PositionalWriter &centroids_writer, // file writer 2: to output centroid
+                                        // vectors
+    PositionalWriter &centroids_id_writer, // file writer 3: to output centroid
+                                           // ids
+    int level, // n-th round recursive clustering, start with 0
     std::vector<ClusteringTask> &output_tasks, // output clustering tasks
     bool vector_use_sq,      // whether use scalar quantization on base vector
     std::vector<T> &max_len, // the max value on each dimension
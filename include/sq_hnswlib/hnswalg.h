@@ -88,7 +88,7 @@ public:
 
   ~HierarchicalNSW() {
 
-    free(data_level0_memory_);
+    freeLevel0();
     for (tableint i = 0; i < cur_element_count; i++) {
       if (element_levels_[i] > 0)
         free(linkLists_[i]);
@@ -135,6 +135,59 @@ public:
 
   bool has_deletions_;
 
+  // set by useHugePages, a level 0 arena on huge pages is an anonymous
+  // mapping of level0_huge_size_ bytes
+  HugePagePolicy huge_page_policy_ = HugePagePolicy::None;
+  size_t level0_huge_size_ = 0;
+
+  // release the level 0 arena however it was allocated
+  void freeLevel0() {
+    if (level0_huge_size_ > 0) {
+      freeHugePages(data_level0_memory_, level0_huge_size_);
+    } else {
+      free(data_level0_memory_);
+    }
+    data_level0_memory_ = nullptr;
+    level0_huge_size_ = 0;
+  }
+
+  // Back the level 0 arena and the visited lists as the policy asks, then
+  // report how much of them the kernel actually put on huge pages, it may
+  // hand out fewer than asked for. Call it before searching; the arena goes
+  // back to malloc if resizeIndex reallocates it. Returns the bytes of the
+  // arena on huge pages.
+  size_t useHugePages(HugePagePolicy policy) {
+    huge_page_policy_ = policy;
+    delete visited_list_pool_;
+    visited_list_pool_ = new VisitedListPool(1, max_elements_, policy);
+
+    size_t bytes = max_elements_ * size_data_per_element_;
+    if (policy != HugePagePolicy::None || level0_huge_size_ > 0) {
+      size_t huge_size;
+      char *arena = (char *)allocHugePages(bytes, policy, &huge_size);
+      if (arena == nullptr)
+        throw std::runtime_error(
+            "Not enough memory: useHugePages failed to allocate level0");
+      memcpy(arena, data_level0_memory_,
+             cur_element_count * size_data_per_element_);
+      freeLevel0();
+      data_level0_memory_ = arena;
+      level0_huge_size_ = huge_size;
+    }
+
+    // the mappings are rounded up to whole huge pages
+    size_t level0_huge = std::min(bytes, hugePageBytes(data_level0_memory_));
+    VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+    size_t visited_huge =
+        std::min(max_elements_ * sizeof(vl_type), hugePageBytes(vl->mass));
+    visited_list_pool_->releaseVisitedList(vl);
+    std::cout << "hnsw sq huge pages, policy " << (int)policy << ": level 0 "
+              << level0_huge << " of " << bytes << " bytes, visited list "
+              << visited_huge << " of " << max_elements_ * sizeof(vl_type)
+              << " bytes" << std::endl;
+    return level0_huge;
+  }
+
   size_t label_offset_;
   DISTFUNC<dist_t> fstdistfunc_;
   void *dist_func_param_;
@@ -642,7 +695,8 @@ public:
                                "current number of elements");
 
     delete visited_list_pool_;
-    visited_list_pool_ = new VisitedListPool(1, new_max_elements);
+    visited_list_pool_ =
+        new VisitedListPool(1, new_max_elements, huge_page_policy_);
 
     element_levels_.resize(new_max_elements);
 
@@ -656,7 +710,7 @@ public:
           "Not enough memory: resizeIndex failed to allocate base layer");
     memcpy(data_level0_memory_new, data_level0_memory_,
            cur_element_count * size_data_per_element_);
-    free(data_level0_memory_);
+    freeLevel0();
     data_level0_memory_ = data_level0_memory_new;
 
     // Reallocate all other layers
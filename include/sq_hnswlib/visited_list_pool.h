@@ -1,9 +1,15 @@
 #pragma once
 
+#include "util/huge_pages.h"
 #include <mutex>
 #include <string.h>
 
 namespace sq_hnswlib {
+using bbann::allocHugePages;
+using bbann::freeHugePages;
+using bbann::HugePagePolicy;
+using bbann::hugePageBytes;
+
 typedef unsigned short int vl_type;
 
 class VisitedList {
@@ -11,11 +17,17 @@ public:
   vl_type curV;
   vl_type *mass;
   unsigned int numelements;
+  size_t mapped_size;
 
-  VisitedList(int numelements1) {
+  VisitedList(int numelements1,
+              HugePagePolicy policy = HugePagePolicy::None) {
     curV = -1;
     numelements = numelements1;
-    mass = new vl_type[numelements];
+    mass = (vl_type *)allocHugePages(sizeof(vl_type) * numelements, policy,
+                                     &mapped_size);
+    if (mass == nullptr)
+      throw std::runtime_error("Not enough memory: VisitedList failed to "
+                               "allocate");
   }
 
   void reset() {
@@ -26,7 +38,7 @@ public:
     }
   };
 
-  ~VisitedList() { delete[] mass; }
+  ~VisitedList() { freeHugePages(mass, mapped_size); }
 };
 ///////////////////////////////////////////////////////////
 //
@@ -38,12 +50,18 @@ class VisitedListPool {
   std::deque<VisitedList *> pool;
   std::mutex poolguard;
   int numelements;
+  HugePagePolicy policy;
 
 public:
-  VisitedListPool(int initmaxpools, int numelements1) {
+  VisitedListPool(int initmaxpools, int numelements1,
+                  HugePagePolicy policy1 = HugePagePolicy::None) {
     numelements = numelements1;
+    // each thread holds a list of 2 bytes per element, rounding that up to
+    // 1GB pages would mostly map memory nobody touches
+    policy = policy1 == HugePagePolicy::HugeTLB1G ? HugePagePolicy::HugeTLB2M
+                                                  : policy1;
     for (int i = 0; i < initmaxpools; i++)
-      pool.push_front(new VisitedList(numelements));
+      pool.push_front(new VisitedList(numelements, policy));
   }
 
   VisitedList *getFreeVisitedList() {
@@ -54,7 +72,7 @@ public:
         rez = pool.front();
         pool.pop_front();
       } else {
-        rez = new VisitedList(numelements);
+        rez = new VisitedList(numelements, policy);
       }
     }
     rez->reset();
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "util/defines.h"
+#include "util/utils_inline.h"
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace bbann {
+
+// Build progress of BBAnnIndex2::BuildWithParameter: the parameters of the
+// build, the finished stages, a few values the later stages depend on and
+// the K1 clusters hierarchical_clusters has finished. It is rewritten
+// (tmp file + rename) on every change, so a build restarted with the same
+// parameters resumes after the last finished unit of work. The output of a
+// unit of work is synced to the disk before it is marked done, the manifest
+// and its directory on every save. A manifest of a build with different
+// parameters is discarded. The shards of a sharded build share the
+// parameters and read each other's manifest to wait for a stage.
+class BuildManifest {
+public:
+  BuildManifest(const std::string &file_name, const BBAnnParameters &para,
+                bool verbose = true)
+      : file_name_(file_name) {
+    params_ = describe(para);
+    load(verbose);
+  }
+
+  // pick up the changes written by another process
+  void reload() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load(false);
+  }
+
+  bool stage_done(const std::string &stage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stages_.count(stage) > 0;
+  }
+
+  void mark_stage_done(const std::string &stage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_.insert(stage);
+    save();
+  }
+
+  bool cluster_done(uint32_t cid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return clusters_.count(cid) > 0;
+  }
+
+  void mark_cluster_done(uint32_t cid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    clusters_.insert(cid);
+    save();
+  }
+
+  std::set<uint32_t> done_clusters() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return clusters_;
+  }
+
+  bool get_value(const std::string &key, double &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = values_.find(key);
+    if (it == values_.end()) {
+      return false;
+    }
+    value = it->second;
+    return true;
+  }
+
+  void set_value(const std::string &key, const double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    values_[key] = value;
+    save();
+  }
+
+private:
+  static std::vector<std::string> describe(const BBAnnParameters &para) {
+    std::vector<std::string> params;
+    params.push_back("dataFilePath " + para.dataFilePath);
+    params.push_back("metric " + std::to_string((int)para.metric));
+    params.push_back("K1 " + std::to_string(para.K1));
+    params.push_back("blockSize " + std::to_string(para.blockSize));
+    params.push_back("hnswM " + std::to_string(para.hnswM));
+    params.push_back("hnswefC " + std::to_string(para.hnswefC));
+    params.push_back("sample " + std::to_string(para.sample));
+    params.push_back("vector_use_sq " + std::to_string(para.vector_use_sq));
+    params.push_back("use_hnsw_sq " + std::to_string(para.use_hnsw_sq));
+    params.push_back("shardNum " + std::to_string(para.shardNum));
+    return params;
+  }
+
+  void load(bool verbose) {
+    std::ifstream in(file_name_);
+    if (!in.is_open()) {
+      return;
+    }
+    std::vector<std::string> params;
+    std::set<std::string> stages;
+    std::set<uint32_t> clusters;
+    std::map<std::string, double> values;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream ss(line);
+      std::string kind;
+      ss >> kind;
+      if (kind == "param") {
+        params.push_back(line.substr(kind.size() + 1));
+      } else if (kind == "stage") {
+        std::string stage;
+        ss >> stage;
+        stages.insert(stage);
+      } else if (kind == "cluster") {
+        uint32_t cid;
+        ss >> cid;
+        clusters.insert(cid);
+      } else if (kind == "value") {
+        std::string key;
+        double value;
+        ss >> key >> value;
+        values[key] = value;
+      }
+    }
+    if (params != params_) {
+      if (!verbose) {
+        return;
+      }
+      std::cout << "build manifest " << file_name_
+                << " was written with different parameters, rebuild from "
+                   "scratch"
+                << std::endl;
+      return;
+    }
+    stages_ = std::move(stages);
+    clusters_ = std::move(clusters);
+    values_ = std::move(values);
+    if (!verbose) {
+      return;
+    }
+    std::cout << "resume build from manifest " << file_name_ << ": "
+              << stages_.size() << " stages and " << clusters_.size()
+              << " clusters done" << std::endl;
+  }
+
+  void save() {
+    std::string tmp_name = file_name_ + ".tmp";
+    {
+      std::ofstream out(tmp_name, std::ios::trunc);
+      for (auto &param : params_) {
+        out << "param " << param << "\n";
+      }
+      out << std::setprecision(17);
+      for (auto &[key, value] : values_) {
+        out << "value " << key << " " << value << "\n";
+      }
+      for (auto &stage : stages_) {
+        out << "stage " << stage << "\n";
+      }
+      for (auto cid : clusters_) {
+        out << "cluster " << cid << "\n";
+      }
+      out.flush();
+      assert(out.good());
+    }
+    util::sync_file(tmp_name);
+    std::rename(tmp_name.c_str(), file_name_.c_str());
+    util::sync_parent_dir(file_name_);
+  }
+
+  std::string file_name_;
+  std::vector<std::string> params_;
+  std::set<std::string> stages_;
+  std::set<uint32_t> clusters_;
+  std::map<std::string, double> values_;
+  std::mutex mutex_;
+};
+
+} // namespace bbann
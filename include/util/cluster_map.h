@@ -0,0 +1,55 @@
+#pragma once
+
+#include <assert.h>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace bbann {
+
+// The K1 cluster whose blocks hold a vector id, so a deletion can be counted
+// against its cluster. Like DeletionBitmap it covers the whole uint32 id space
+// in an anonymous mapping that is only backed by memory where ids are set,
+// one byte per id. Ids in no cluster, like the ones still in the delta, map
+// to NONE. Not thread safe, the owner serializes the access.
+class ClusterMap {
+public:
+  constexpr static uint32_t NONE = 0xffffffff;
+  // the entries store cid + 1, an untouched zero page maps to NONE. the
+  // clusters from MAX_CLUSTERS on can not be stored.
+  constexpr static uint32_t MAX_CLUSTERS = 0xff;
+
+  ClusterMap() {
+    cids_ = (uint8_t *)mmap(nullptr, IDS_NUM, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cids_ == MAP_FAILED) {
+      std::cout << "mmap() of the cluster map failed, errno: " << errno
+                << ", error: " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+  }
+
+  ~ClusterMap() { munmap(cids_, IDS_NUM); }
+
+  ClusterMap(const ClusterMap &) = delete;
+  ClusterMap &operator=(const ClusterMap &) = delete;
+
+  void set(uint32_t id, uint32_t cid) {
+    assert(cid < MAX_CLUSTERS);
+    cids_[id] = cid + 1;
+  }
+
+  uint32_t get(uint32_t id) const {
+    return cids_[id] == 0 ? NONE : cids_[id] - 1;
+  }
+
+private:
+  constexpr static uint64_t IDS_NUM = 1ULL << 32;
+
+  uint8_t *cids_ = nullptr;
+};
+
+} // namespace bbann
@@ -33,6 +33,21 @@ constexpr static int MIN_SAME_SIZE_THRESHOLD = 500;
 
 constexpr static int MAX_SAME_SIZE_THRESHOLD = 1500;
 
+// number of nearest centroids kept per point by same size kmeans
+constexpr static int SSK_CANDIDATES_NUM = 32;
+
+// same size kmeans keeps the full point to centroid distance table while it
+// has at most this many entries, or k <= 2 * SSK_CANDIDATES_NUM
+constexpr static int64_t SSK_DENSE_TABLE_MAX = 1 << 20;
+
+// max number of K1 clusters held in memory by hierarchical_clusters at once
+// under a memory budget, the next cluster is loaded while the tail tasks of
+// the previous one run. without a budget it is one.
+constexpr static int MAX_INFLIGHT_K1_CLUSTERS = 2;
+
+// max bytes of the per-thread partial sums in compute_centroids
+constexpr static uint64_t COMPUTE_CENTROIDS_BUFFER_BYTES = 256 * MEGABYTE;
+
 // the prunning rate of dynamic search
 constexpr static float SEARCH_PRUNING_RATE = 0.9;
 
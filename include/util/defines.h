@@ -1,4 +1,5 @@
 #pragma once
+#include <string>
 
 // type definations
 //
@@ -49,6 +50,25 @@ struct BBAnnParameters {
   bool vector_use_sq = false;
   double radiusFactor = 1.0;
   bool use_hnsw_sq = false;
+  // memory budget of hierarchical_clusters in GB, K1 clusters larger than the
+  // budget are split into on-disk partitions first. 0 means no limit.
+  double buildMemoryBudgetGB = 0;
+  // sharded build: the process builds the K1 clusters with
+  // cid % shardNum == shardId. shard 0 also trains and divides the data
+  // before and merges the shards and builds the graph after.
+  int shardNum = 1;
+  int shardId = 0;
+  // load the hnsw router with its level 0 links compressed, which saves
+  // memory at the cost of decoding them during the search
+  bool hnswCompressLinks = false;
+  // map hnsw-index.bin read only instead of reading it into memory, the
+  // processes serving the same index share its pages
+  bool hnswMmapLoad = false;
+  // back the router's level 0 arena and visited lists with huge pages:
+  // 0 off, 1 transparent, 2 hugetlbfs 2MB, 3 hugetlbfs 1GB. hugetlbfs falls
+  // back to the smaller pages when its pool is short. The visited lists use
+  // 2MB pages at most.
+  int hnswHugePages = 0;
 };
 
 } // namespace bbann
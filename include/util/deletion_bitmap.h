@@ -0,0 +1,177 @@
+#pragma once
+
+#include "util/utils_inline.h"
+#include <assert.h>
+#include <atomic>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <unordered_set>
+#include <unistd.h>
+#include <vector>
+
+namespace bbann {
+
+// Tombstones of deleted vectors, one bit per uint32 vector id. The bitmap
+// covers the whole id space in an anonymous mapping that is only backed by
+// memory where ids are deleted, so it never has to grow under concurrent
+// readers. Deleted ids are appended to a log file that is replayed on load.
+// A deleted id must not be inserted again until compaction has dropped it
+// from the blocks.
+class DeletionBitmap {
+public:
+  DeletionBitmap() {
+    words_ = (std::atomic<uint64_t> *)mmap(
+        nullptr, WORDS_NUM * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (words_ == MAP_FAILED) {
+      std::cout << "mmap() of the deletion bitmap failed, errno: " << errno
+                << ", error: " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+  }
+
+  ~DeletionBitmap() {
+    if (log_fd_ >= 0) {
+      close(log_fd_);
+    }
+    munmap(words_, WORDS_NUM * sizeof(uint64_t));
+  }
+
+  // replay the log file if it exists, the following deletions are appended
+  // to it. a partial id at the tail, torn by a crash, is truncated.
+  void Open(const std::string &log_file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    log_file_ = log_file;
+    if (access(log_file.c_str(), F_OK) != 0) {
+      return;
+    }
+    uint64_t file_size = util::fsize(log_file);
+    uint64_t n = file_size / sizeof(uint32_t);
+    if (n * sizeof(uint32_t) != file_size) {
+      std::cout << "deleted ids file " << log_file << " has a torn tail of "
+                << file_size - n * sizeof(uint32_t) << " bytes, truncate it"
+                << std::endl;
+      if (truncate(log_file.c_str(), n * sizeof(uint32_t)) != 0) {
+        std::cout << "truncate() failed, file: " << log_file
+                  << ", errno: " << errno << ", error: " << strerror(errno)
+                  << std::endl;
+        exit(-1);
+      }
+    }
+    logged_.resize(n);
+    std::ifstream reader(log_file, std::ios::binary);
+    reader.read((char *)logged_.data(), n * sizeof(uint32_t));
+    for (auto id : logged_) {
+      set(id);
+    }
+    std::cout << "replay " << count_ << " deleted ids from " << log_file
+              << std::endl;
+  }
+
+  void Delete(const uint32_t *ids, uint64_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!log_file_.empty()) {
+      if (log_fd_ < 0) {
+        log_fd_ = open(log_file_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log_fd_ < 0) {
+          std::cout << "open() failed, file: " << log_file_
+                    << ", errno: " << errno << ", error: " << strerror(errno)
+                    << std::endl;
+          exit(-1);
+        }
+      }
+      auto r = write(log_fd_, ids, n * sizeof(uint32_t));
+      if (r != (ssize_t)(n * sizeof(uint32_t)) || fdatasync(log_fd_) != 0) {
+        std::cout << "write() failed, file: " << log_file_
+                  << ", errno: " << errno << ", error: " << strerror(errno)
+                  << std::endl;
+        exit(-1);
+      }
+    }
+    logged_.insert(logged_.end(), ids, ids + n);
+    for (uint64_t i = 0; i < n; i++) {
+      set(ids[i]);
+    }
+  }
+
+  // number of ids in the log
+  uint64_t log_size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return logged_.size();
+  }
+
+  // the logged ids, oldest first
+  std::vector<uint32_t> logged() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return logged_;
+  }
+
+  // write the logged ids from position `from` on as a log file
+  void WriteLog(uint64_t from, const std::string &file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(from <= logged_.size());
+    std::ofstream writer(file, std::ios::binary | std::ios::trunc);
+    writer.write((char *)(logged_.data() + from),
+                 (logged_.size() - from) * sizeof(uint32_t));
+    writer.close();
+    assert(!writer.fail());
+  }
+
+  // forget the first n logged ids once compaction has dropped them from the
+  // blocks, unless they were deleted again later. the log file has been
+  // replaced by then, it is reopened by the next Delete.
+  void Truncate(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(n <= logged_.size());
+    std::unordered_set<uint32_t> again(logged_.begin() + n, logged_.end());
+    for (uint64_t i = 0; i < n; i++) {
+      if (again.count(logged_[i]) == 0) {
+        clear(logged_[i]);
+      }
+    }
+    logged_.erase(logged_.begin(), logged_.begin() + n);
+    if (log_fd_ >= 0) {
+      close(log_fd_);
+      log_fd_ = -1;
+    }
+  }
+
+  bool test(uint32_t id) const {
+    return (words_[id >> 6].load(std::memory_order_relaxed) >> (id & 63)) & 1;
+  }
+
+  // number of deleted ids
+  uint64_t count() const { return count_; }
+
+private:
+  // 2^32 ids, 64 per word
+  constexpr static uint64_t WORDS_NUM = (1ULL << 32) / 64;
+
+  void set(uint32_t id) {
+    uint64_t bit = 1ULL << (id & 63);
+    if (!(words_[id >> 6].fetch_or(bit, std::memory_order_relaxed) & bit)) {
+      count_++;
+    }
+  }
+
+  void clear(uint32_t id) {
+    uint64_t bit = 1ULL << (id & 63);
+    if (words_[id >> 6].fetch_and(~bit, std::memory_order_relaxed) & bit) {
+      count_--;
+    }
+  }
+
+  std::atomic<uint64_t> *words_ = nullptr;
+  std::atomic<uint64_t> count_{0};
+  std::vector<uint32_t> logged_;
+  std::string log_file_;
+  int log_fd_ = -1;
+  std::mutex mutex_;
+};
+
+} // namespace bbann
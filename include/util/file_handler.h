@@ -6,14 +6,18 @@
 #include <cstring>
 #include <fcntl.h> // open
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <libaio.h>
+#include <limits>
 #include <mutex>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
-#include <unistd.h> // pread
+#include <unistd.h> // pread, pwrite
 
 namespace ioreader {
 constexpr static uint64_t KILOBYTE = 1024;
@@ -21,81 +25,157 @@ constexpr static uint64_t MEGABYTE = 1024 * 1024;
 constexpr static uint64_t GIGABYTE = 1024 * 1024 * 1024;
 } // namespace ioreader
 
+// Reads a file through a read-only mapping, the pages ahead of the cursor are
+// requested in windows of cache_size bytes. read() copies the bytes out,
+// view() hands them out in place and stays valid while the reader lives.
+// fetch() is view() with the bytes paged in before it returns.
 class IOReader {
 
 public:
   IOReader(const std::string &file_name,
-           const uint64_t cache_size = ioreader::GIGABYTE)
-      : cache_size_(cache_size), cur_off_(0) {
-    reader_.open(file_name, std::ios::binary | std::ios::ate);
-    assert(reader_.is_open() == true);
-    reader_.seekg(0, reader_.end);
-    fsize_ = reader_.tellg();
-    reader_.seekg(0, reader_.beg);
-    assert(cache_size_ > 0);
-    cache_size_ = (std::min)(cache_size_, fsize_);
-    cache_buf_ = (char *)malloc(cache_size_);
-    assert(cache_buf_ != nullptr);
-    reader_.read(cache_buf_, cache_size_);
+           const uint64_t cache_size = 64 * ioreader::MEGABYTE)
+      : file_name_(file_name) {
+    assert(cache_size > 0);
+    window_ = (cache_size + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      std::cout << "open() failed, file: " << file_name_ << ", errno: " << errno
+                << ", error: " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+    fsize_ = st.st_size;
+    if (fsize_ > 0) {
+      data_ = (char *)mmap(nullptr, fsize_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data_ == MAP_FAILED) {
+        std::cout << "mmap() failed, file: " << file_name_
+                  << ", errno: " << errno << ", error: " << strerror(errno)
+                  << std::endl;
+        exit(-1);
+      }
+      madvise(data_, fsize_, MADV_SEQUENTIAL);
+      read_ahead();
+    }
+    close(fd);
   }
 
   ~IOReader() {
-    free(cache_buf_);
-    reader_.close();
+    if (data_ != nullptr) {
+      munmap(data_, fsize_);
+    }
   }
 
+  IOReader(const IOReader &) = delete;
+  IOReader &operator=(const IOReader &) = delete;
+
   uint64_t get_file_size() { return fsize_; }
 
   void read(char *read_buf, const uint64_t n_bytes) {
     assert(read_buf != nullptr);
-    assert(cache_buf_ != nullptr);
-    if (cur_off_ + n_bytes <= cache_size_) {
-      memcpy(read_buf, cache_buf_ + cur_off_, n_bytes);
-      cur_off_ += n_bytes;
-    } else {
-      auto in_cache = cache_size_ - cur_off_;
-      assert(n_bytes - in_cache <= fsize_ - reader_.tellg());
-      memcpy(read_buf, cache_buf_ + cur_off_, in_cache);
-      cur_off_ = cache_size_;
-      reader_.read(read_buf + in_cache, n_bytes - in_cache);
-      if (cache_size_ <= fsize_ - reader_.tellg()) {
-        reader_.read(cache_buf_, cache_size_);
-        cur_off_ = 0;
-      }
+    memcpy(read_buf, view(n_bytes), n_bytes);
+  }
+
+  // the next n_bytes of the file in place
+  const char *view(const uint64_t n_bytes) {
+    assert(cur_off_ + n_bytes <= fsize_);
+    const char *p = data_ + cur_off_;
+    cur_off_ += n_bytes;
+    read_ahead();
+    return p;
+  }
+
+  // the next n_bytes of the file in place, read into memory by the calling
+  // thread so the caller does not fault on them
+  const char *fetch(const uint64_t n_bytes) {
+    const char *p = view(n_bytes);
+    if (n_bytes == 0) {
+      return p;
+    }
+    uint64_t begin = (p - data_) / PAGESIZE * PAGESIZE;
+    madvise(data_ + begin, p + n_bytes - data_ - begin, MADV_WILLNEED);
+    volatile char sink = 0;
+    for (uint64_t off = begin; off < (uint64_t)(p + n_bytes - data_);
+         off += PAGESIZE) {
+      sink = sink + data_[off];
     }
+    return p;
   }
 
 private:
-  // underlying ifstream
-  std::ifstream reader_;
-  // # bytes to cache in one shot read
-  uint64_t cache_size_ = 0;
-  // underlying buf for cache
-  char *cache_buf_ = nullptr;
-  // offset into cache_buf for cur_pos
+  constexpr static uint64_t PAGESIZE = 4096;
+
+  // keep a window requested ahead of the cursor
+  void read_ahead() {
+    while (ahead_ < fsize_ && ahead_ < cur_off_ + window_) {
+      uint64_t len = std::min(window_, fsize_ - ahead_);
+      madvise(data_ + ahead_, len, MADV_WILLNEED);
+      ahead_ += len;
+    }
+  }
+
+  std::string file_name_;
+  char *data_ = nullptr;
+  // # bytes requested ahead of the cursor at once
+  uint64_t window_ = 0;
+  // the bytes before this offset have been requested
+  uint64_t ahead_ = 0;
   uint64_t cur_off_ = 0;
   // file size
   uint64_t fsize_ = 0;
 };
 
+// Writes through two aligned buffers: while one is filled, the other is
+// written out by a background task. Whole aligned buffers go to the file with
+// O_DIRECT so the build output does not crowd the page cache, the unaligned
+// tail is written through a buffered descriptor by flush() and on close. The
+// file is preallocated ahead of the writes. Where the filesystem refuses
+// O_DIRECT the writes are buffered.
 class IOWriter {
 public:
   IOWriter(const std::string &file_name,
-           const uint64_t cache_size = ioreader::GIGABYTE)
-      : cache_size_(cache_size), cur_off_(0) {
-    writer_.open(file_name, std::ios::binary);
+           const uint64_t cache_size = 64 * ioreader::MEGABYTE)
+      : file_name_(file_name) {
     std::cout << "writing file" << file_name << std::endl;
-    assert(writer_.is_open() == true);
-    assert(cache_size_ > 0);
-    cache_buf_ = (char *)malloc(cache_size_);
-    assert(cache_buf_ != nullptr);
+    assert(cache_size > 0);
+    cache_size_ = (cache_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+               0644);
+    if (fd_ < 0 && errno == EINVAL) {
+      direct_ = false;
+      fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    tail_fd_ = fd_ < 0 ? -1 : open(file_name.c_str(), O_WRONLY);
+    if (fd_ < 0 || tail_fd_ < 0) {
+      std::cout << "open() failed, file: " << file_name_ << ", errno: " << errno
+                << ", error: " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+    for (int i = 0; i < 2; i++) {
+      auto r = posix_memalign((void **)&bufs_[i], ALIGNMENT, cache_size_);
+      assert(r == 0);
+    }
   }
+  IOWriter(const IOWriter &) = delete;
+  IOWriter &operator=(const IOWriter &) = delete;
+
   ~IOWriter() {
-    if (cur_off_ > 0) {
-      flush();
+    flush();
+    // release the preallocation past the end
+    if (ftruncate(tail_fd_, cur_pos_) != 0) {
+      std::cout << "ftruncate() failed, file: " << file_name_
+                << ", errno: " << errno << ", error: " << strerror(errno)
+                << std::endl;
+    }
+    // the file is on the disk once the writer is gone
+    if (fsync(fd_) != 0) {
+      std::cout << "fsync() failed, file: " << file_name_
+                << ", errno: " << errno << ", error: " << strerror(errno)
+                << std::endl;
     }
-    free(cache_buf_);
-    writer_.close();
+    close(fd_);
+    close(tail_fd_);
+    free(bufs_[0]);
+    free(bufs_[1]);
   }
 
   // returns current position in the output stream
@@ -103,45 +183,159 @@ public:
 
   uint64_t get_file_size() { return fsize_; }
 
-  void write(char *buff, const uint64_t n_bytes) {
+  void write(const char *buff, const uint64_t n_bytes) {
     assert(buff != nullptr);
-    cur_pos_ += n_bytes;
-
-    if (n_bytes + cur_off_ <= cache_size_) {
-      memcpy(cache_buf_ + cur_off_, buff, n_bytes);
-      cur_off_ += n_bytes;
-    } else {
-      writer_.write(cache_buf_, cur_off_);
-      fsize_ += cur_off_;
-      writer_.write(buff, n_bytes);
-      fsize_ += n_bytes;
-      memset(cache_buf_, 0, cache_size_);
-      cur_off_ = 0;
+    uint64_t done = 0;
+    while (done < n_bytes) {
+      uint64_t n = std::min(n_bytes - done, cache_size_ - cur_off_);
+      memcpy(bufs_[active_] + cur_off_, buff + done, n);
+      cur_off_ += n;
+      cur_pos_ += n;
+      done += n;
+      if (cur_off_ == cache_size_) {
+        submit();
+      }
     }
   }
 
+  // the written data reaches the file
   void flush() {
-    if (cur_off_ > 0) {
-      writer_.write(cache_buf_, cur_off_);
-      fsize_ += cur_off_;
+    wait();
+    uint64_t aligned = cur_off_ / ALIGNMENT * ALIGNMENT;
+    if (aligned > 0) {
+      write_at(fd_, bufs_[active_], aligned, file_off_);
+    }
+    uint64_t tail = cur_off_ - aligned;
+    if (tail > 0) {
+      // the tail stays in the buffer and is written again once it is filled
+      write_at(tail_fd_, bufs_[active_] + aligned, tail, file_off_ + aligned);
+      memmove(bufs_[active_], bufs_[active_] + aligned, tail);
     }
+    file_off_ += aligned;
+    cur_off_ = tail;
+    fsize_ = cur_pos_;
   }
 
 private:
-  // underlying ofstream
-  std::ofstream writer_;
-  // # bytes to cache for one shot write
+  constexpr static uint64_t ALIGNMENT = 4096;
+  // buffers preallocated ahead of the writes
+  constexpr static uint64_t PREALLOCATE_BUFFERS = 4;
+
+  // hand the full buffer to the background task and fill the other one
+  void submit() {
+    wait();
+    if (file_off_ + cur_off_ > allocated_) {
+      uint64_t len = PREALLOCATE_BUFFERS * cache_size_;
+      // best effort, not every filesystem supports it
+      if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, len) == 0) {
+        allocated_ += len;
+      } else {
+        allocated_ = std::numeric_limits<uint64_t>::max();
+      }
+    }
+    char *buf = bufs_[active_];
+    uint64_t len = cur_off_, off = file_off_;
+    pending_ = std::async(std::launch::async, [this, buf, len, off]() {
+      write_at(fd_, buf, len, off);
+    });
+    file_off_ += len;
+    fsize_ = file_off_;
+    active_ ^= 1;
+    cur_off_ = 0;
+  }
+
+  void wait() {
+    if (pending_.valid()) {
+      pending_.get();
+    }
+  }
+
+  void write_at(int fd, const char *buf, uint64_t len, uint64_t off) {
+    uint64_t done = 0;
+    while (done < len) {
+      auto ret = pwrite(fd, buf + done, len - done, off + done);
+      if (ret < 0 && errno == EINVAL && fd == fd_ && direct_) {
+        // O_DIRECT accepted by open() but not by the filesystem
+        direct_ = false;
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+        continue;
+      }
+      if (ret <= 0) {
+        std::cout << "pwrite() failed, file: " << file_name_
+                  << ", offset: " << off + done << ", errno: " << errno
+                  << ", error: " << strerror(errno) << std::endl;
+        exit(-1);
+      }
+      done += ret;
+    }
+  }
+
+  std::string file_name_;
+  // O_DIRECT descriptor for the aligned buffers, buffered one for the tail
+  int fd_ = -1;
+  int tail_fd_ = -1;
+  bool direct_ = true;
+  // # bytes of each buffer
   uint64_t cache_size_ = 0;
-  // underlying buf for cache
-  char *cache_buf_ = nullptr;
-  // offset into cache_buf for cur_pos
+  char *bufs_[2] = {nullptr, nullptr};
+  // the buffer being filled
+  int active_ = 0;
+  // offset into the active buffer for cur_pos
   uint64_t cur_off_ = 0;
+  // file offset of the active buffer
+  uint64_t file_off_ = 0;
   uint64_t cur_pos_ = 0;
+  // file bytes preallocated so far
+  uint64_t allocated_ = 0;
+  // the write of the other buffer
+  std::future<void> pending_;
 
   // file size
   uint64_t fsize_ = 0;
 };
 
+// writes at offsets given by the caller, threads writing disjoint ranges of
+// the file need no lock. the file is on the disk once the writer is gone.
+class PositionalWriter {
+public:
+  PositionalWriter(const std::string &file_name) : file_name_(file_name) {
+    fd_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      std::cout << "open() failed, file: " << file_name_ << ", errno: " << errno
+                << ", error: " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+  }
+  ~PositionalWriter() {
+    if (fsync(fd_) != 0) {
+      std::cout << "fsync() failed, file: " << file_name_
+                << ", errno: " << errno << ", error: " << strerror(errno)
+                << std::endl;
+    }
+    close(fd_);
+  }
+
+  void write_at(const char *buff, const uint64_t n_bytes,
+                const uint64_t offset) {
+    assert(buff != nullptr);
+    uint64_t done = 0;
+    while (done < n_bytes) {
+      auto ret = pwrite(fd_, buff + done, n_bytes - done, offset + done);
+      if (ret <= 0) {
+        std::cout << "pwrite() failed, file: " << file_name_
+                  << ", offset: " << offset + done << ", errno: " << errno
+                  << ", error: " << strerror(errno) << std::endl;
+        exit(-1);
+      }
+      done += ret;
+    }
+  }
+
+private:
+  std::string file_name_;
+  int fd_ = -1;
+};
+
 namespace bbann {
 
 constexpr int MAX_EVENTS_NUM = 1023;
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace bbann {
+
+// Backing of the arrays every graph hop touches at random, the level 0 arena
+// and the visited lists of hnswlib and sq_hnswlib.
+enum class HugePagePolicy {
+  None = 0,        // plain malloc
+  Transparent = 1, // anonymous mapping advised with MADV_HUGEPAGE
+  HugeTLB2M = 2,   // 2MB pages of the hugetlbfs pool
+  HugeTLB1G = 3,   // 1GB pages of the hugetlbfs pool
+};
+
+constexpr static size_t HUGE_PAGE_2M = 2UL << 20;
+constexpr static size_t HUGE_PAGE_1G = 1UL << 30;
+
+// Allocate bytes backed as the policy asks. hugetlbfs pages fall back to the
+// smaller size and then to transparent huge pages when the pool is short.
+// The block is an anonymous mapping of *mapped_size bytes, to be released by
+// freeHugePages, or malloc'ed with *mapped_size 0 for HugePagePolicy::None.
+// Returns nullptr if nothing could be allocated.
+inline void *allocHugePages(size_t bytes, HugePagePolicy policy,
+                            size_t *mapped_size) {
+  *mapped_size = 0;
+  if (policy == HugePagePolicy::None) {
+    return malloc(bytes);
+  }
+  const int anon = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (policy == HugePagePolicy::HugeTLB1G) {
+    size_t size = (bytes + HUGE_PAGE_1G - 1) / HUGE_PAGE_1G * HUGE_PAGE_1G;
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   anon | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+    if (p != MAP_FAILED) {
+      *mapped_size = size;
+      return p;
+    }
+  }
+  if (policy != HugePagePolicy::Transparent) {
+    size_t size = (bytes + HUGE_PAGE_2M - 1) / HUGE_PAGE_2M * HUGE_PAGE_2M;
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   anon | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (p != MAP_FAILED) {
+      *mapped_size = size;
+      return p;
+    }
+  }
+  // over-allocate by one page to align the start to a huge page
+  size_t size = (bytes + HUGE_PAGE_2M - 1) / HUGE_PAGE_2M * HUGE_PAGE_2M;
+  char *p = (char *)mmap(nullptr, size + HUGE_PAGE_2M, PROT_READ | PROT_WRITE,
+                         anon, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  char *aligned =
+      (char *)(((uintptr_t)p + HUGE_PAGE_2M - 1) & ~(HUGE_PAGE_2M - 1));
+  if (aligned > p) {
+    munmap(p, aligned - p);
+  }
+  munmap(aligned + size, p + HUGE_PAGE_2M - aligned);
+  madvise(aligned, size, MADV_HUGEPAGE);
+  *mapped_size = size;
+  return aligned;
+}
+
+inline void freeHugePages(void *p, size_t mapped_size) {
+  if (mapped_size == 0) {
+    free(p);
+  } else {
+    munmap(p, mapped_size);
+  }
+}
+
+// Bytes of the mapping holding addr that the kernel backs with huge pages,
+// transparent or hugetlbfs, anonymous or file, read from /proc/self/smaps.
+inline size_t hugePageBytes(const void *addr) {
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  bool inside = false;
+  size_t kb = 0;
+  while (std::getline(smaps, line)) {
+    uintptr_t start, end;
+    char dash;
+    std::istringstream ss(line);
+    // mapping headers start with "start-end", the fields with a name
+    if (ss >> std::hex >> start >> dash >> end && dash == '-') {
+      if (inside) {
+        break;
+      }
+      inside = start <= (uintptr_t)addr && (uintptr_t)addr < end;
+      continue;
+    }
+    if (!inside) {
+      continue;
+    }
+    std::istringstream field(line);
+    std::string name;
+    size_t value;
+    field >> name >> value;
+    if (name == "AnonHugePages:" || name == "FilePmdMapped:" ||
+        name == "Shared_Hugetlb:" || name == "Private_Hugetlb:") {
+      kb += value;
+    }
+  }
+  return kb * 1024;
+}
+
+} // namespace bbann
@@ -1,6 +1,9 @@
 #pragma once
 #include "util/defines.h"
 #include "util/distance.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -8,6 +11,7 @@
 #include <random>
 #include <string>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
@@ -74,6 +78,26 @@ inline uint64_t fsize(const std::string filename) {
   stat(filename.c_str(), &st);
   return st.st_size;
 }
+
+// flush a file or a directory to the disk
+inline void sync_file(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0 || fsync(fd) != 0) {
+    std::cout << "fsync() failed, file: " << path << ", errno: " << errno
+              << ", error: " << strerror(errno) << std::endl;
+    exit(-1);
+  }
+  close(fd);
+}
+
+// a file renamed into a directory survives a crash only once the directory
+// is synced too
+inline void sync_parent_dir(const std::string &path) {
+  auto slash = path.rfind('/');
+  sync_file(slash == std::string::npos ? "."
+            : slash == 0                ? "/"
+                                        : path.substr(0, slash));
+}
 inline void rand_perm(int64_t *perm, int64_t n, int64_t k, int64_t seed) {
   std::mt19937 generator(seed);
 
@@ -159,6 +183,28 @@ inline std::string getClusterGlobalIdsFileName(std::string prefix,
 inline std::string getSQMetaFileName(std::string prefix) {
   return prefix + "meta";
 }
+inline std::string getK1CentroidsFileName(std::string prefix) {
+  return prefix + "k1-centroids.bin";
+}
+inline std::string getBuildManifestFileName(std::string prefix) {
+  return prefix + "build-manifest.txt";
+}
+inline std::string getDeltaWalFileName(std::string prefix) {
+  return prefix + "delta.wal";
+}
+inline std::string getDeletedIdsFileName(std::string prefix) {
+  return prefix + "deleted-ids.bin";
+}
+inline std::string getCompactJournalFileName(std::string prefix) {
+  return prefix + "compact-journal.txt";
+}
+// the file of one shard of a sharded build: name.ext -> name.shard-<id>.ext
+inline std::string getShardFileName(const std::string &file_name,
+                                    int shard_id) {
+  auto pos = file_name.rfind('.');
+  return file_name.substr(0, pos) + ".shard-" + std::to_string(shard_id) +
+         file_name.substr(pos);
+}
 
 inline float rand_float() {
   static std::mt19937 generator(1234);
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bbann {
+
+// A fixed-size thread pool where every worker owns a task deque. Tasks
+// submitted from a worker go to the back of its own deque and are popped LIFO
+// (the freshly split sub-task is still hot in cache), idle workers steal from
+// the front of other workers' deques. Tasks submitted from outside the pool
+// are spread round-robin. A running task may reserve idle workers for threads
+// of its own, a worker only starts a task while running tasks and
+// reservations leave it a core.
+class WorkStealingPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit WorkStealingPool(size_t num_workers = 0) {
+    if (num_workers == 0) {
+      num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+      queues_.emplace_back(std::make_unique<WorkerQueue>());
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+      workers_.emplace_back([this, i]() { run(i); });
+    }
+  }
+
+  ~WorkStealingPool() {
+    wait_idle();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &w : workers_) {
+      w.join();
+    }
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  // number of workers currently running a task
+  size_t active() const { return active_.load(); }
+
+  // reserve up to n of the idle workers, they start no task until released.
+  // returns the number reserved.
+  size_t reserve(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t busy = active_.load() + reserved_;
+    size_t got = busy < workers_.size() ? std::min(n, workers_.size() - busy)
+                                        : 0;
+    reserved_ += got;
+    return got;
+  }
+
+  void release(size_t n) {
+    if (n == 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      reserved_ -= n;
+    }
+    cv_.notify_all();
+  }
+
+  void submit(Task task) {
+    size_t id = (tls_pool_ == this) ? tls_worker_id_
+                                    : (next_queue_++ % queues_.size());
+    // count the task before it becomes visible, a worker may steal and
+    // finish it before this thread gets past the push
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_++;
+      unfinished_++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues_[id]->mutex);
+      queues_[id]->tasks.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+  // block until every submitted task, including the ones submitted by tasks,
+  // has finished.
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this]() { return unfinished_ == 0; });
+  }
+
+private:
+  struct WorkerQueue {
+    std::deque<Task> tasks;
+    std::mutex mutex;
+  };
+
+  bool pop_local(size_t id, Task &task) {
+    std::lock_guard<std::mutex> lock(queues_[id]->mutex);
+    if (queues_[id]->tasks.empty()) {
+      return false;
+    }
+    task = std::move(queues_[id]->tasks.back());
+    queues_[id]->tasks.pop_back();
+    return true;
+  }
+
+  bool steal(size_t id, Task &task) {
+    for (size_t k = 1; k < queues_.size(); k++) {
+      auto &q = queues_[(id + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q->mutex);
+      if (!q->tasks.empty()) {
+        task = std::move(q->tasks.front());
+        q->tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(size_t id) {
+    tls_pool_ = this;
+    tls_worker_id_ = id;
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() {
+          return stop_ ||
+                 (queued_ > 0 && active_.load() + reserved_ < workers_.size());
+        });
+        if (stop_ && queued_ == 0) {
+          break;
+        }
+        // a counted task may not be pushed yet, then this worker retries
+        if (!pop_local(id, task) && !steal(id, task)) {
+          continue;
+        }
+        queued_--;
+        active_++;
+      }
+      task();
+      active_--;
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--unfinished_ == 0) {
+        idle_cv_.notify_all();
+      }
+      // a worker held back while this one ran may start now
+      cv_.notify_one();
+    }
+    tls_pool_ = nullptr;
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> active_{0};
+
+  // guards the counters below, cv_ wakes sleeping workers, idle_cv_ wakes
+  // wait_idle()
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable idle_cv_;
+  size_t queued_ = 0;
+  size_t unfinished_ = 0;
+  // idle workers held back by reserve()
+  size_t reserved_ = 0;
+  bool stop_ = false;
+
+  inline static thread_local WorkStealingPool *tls_pool_ = nullptr;
+  inline static thread_local size_t tls_worker_id_ = 0;
+};
+
+} // namespace bbann
@@ -59,6 +59,34 @@ void IndexBindWrapper(py::module_ &m) {
            },
            py::arg("query"), py::arg("dim"), py::arg("num_query"),
            py::arg("knn"), py::arg("para"))
+      .def("insert",
+           [](indexT &self,
+              py::array_t<dataT, py::array::c_style | py::array::forcecast>
+                  &data,
+              py::array_t<unsigned, py::array::c_style | py::array::forcecast>
+                  &ids) {
+             if (self.delta_ == nullptr) {
+               throw std::runtime_error("insert needs a loaded index");
+             }
+             if ((uint64_t)data.size() !=
+                 (uint64_t)ids.size() * self.delta_->dim()) {
+               throw py::value_error(
+                   "data has " + std::to_string(data.size()) +
+                   " values, expected " + std::to_string(ids.size()) +
+                   " ids times dim " + std::to_string(self.delta_->dim()));
+             }
+             // the write-ahead file is synced, let other threads run
+             py::gil_scoped_release release;
+             self.Insert(data.data(), ids.data(), ids.size());
+           },
+           py::arg("data"), py::arg("ids"))
+      .def("delete",
+           [](indexT &self,
+              py::array_t<unsigned, py::array::c_style | py::array::forcecast>
+                  &ids) { self.Delete(ids.data(), ids.size()); },
+           py::arg("ids"), py::call_guard<py::gil_scoped_release>())
+      .def("compact", &indexT::Compact, py::arg("para"),
+           py::call_guard<py::gil_scoped_release>())
       .def("range_search",
            [](indexT &self,
               py::array_t<dataT, py::array::c_style | py::array::forcecast>
@@ -161,7 +189,14 @@ PYBIND11_MODULE(bbannpy, m) {
       .def_readwrite("blockSize", &BBAnnParameters::blockSize)
       .def_readwrite("sample", &BBAnnParameters::sample)
       .def_readwrite("vector_use_sq", &BBAnnParameters::vector_use_sq)
-      .def_readwrite("use_hnsw_sq", &BBAnnParameters::use_hnsw_sq);
+      .def_readwrite("use_hnsw_sq", &BBAnnParameters::use_hnsw_sq)
+      .def_readwrite("buildMemoryBudgetGB",
+                     &BBAnnParameters::buildMemoryBudgetGB)
+      .def_readwrite("shardNum", &BBAnnParameters::shardNum)
+      .def_readwrite("shardId", &BBAnnParameters::shardId)
+      .def_readwrite("hnswCompressLinks", &BBAnnParameters::hnswCompressLinks)
+      .def_readwrite("hnswMmapLoad", &BBAnnParameters::hnswMmapLoad)
+      .def_readwrite("hnswHugePages", &BBAnnParameters::hnswHugePages);
 #define CLASSWRAPPER_DECL(className, index)                                    \
   class className {                                                            \
   public:                                                                      \
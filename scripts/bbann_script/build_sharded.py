@@ -0,0 +1,68 @@
+#!/usr/bin/python3
+# Build one index with several processes on this host (or, with the index
+# folder on a shared filesystem, one process per host with --shard-id).
+#
+# Usage: build_sharded.py <data_type> <data_file> <index_path> <metric_type>
+#            <K1> <hnswM> <hnswefC> <shard_num> [--shard-id <id>]
+#
+#   data_type: uint8, int8 or float
+#   metric_type: L2 or IP
+#   index_path: /path/to/index/files/, must end with a slash
+#
+# Without --shard-id all the shards are started as local processes. Shard 0
+# trains and divides the data, every shard clusters the K1 clusters with
+# cid % shard_num == shard_id, and shard 0 merges the shards and builds the
+# graph. A killed shard resumes from its manifest when started again.
+import subprocess
+import sys
+
+import bbannpy
+
+
+def build_shard(data_type, data_file, index_path, metric_type, K1, hnswM,
+                hnswefC, shard_num, shard_id):
+    para = bbannpy.BBAnnParameters()
+    para.dataFilePath = data_file
+    para.indexPrefixPath = index_path
+    para.metric = bbannpy.L2 if metric_type == "L2" else bbannpy.INNER_PRODUCT
+    para.K1 = K1
+    para.hnswM = hnswM
+    para.hnswefC = hnswefC
+    para.blockSize = 4096
+    para.shardNum = shard_num
+    para.shardId = shard_id
+    if data_type == "float":
+        index = bbannpy.FloatIndex(para.metric)
+    elif data_type == "int8":
+        index = bbannpy.Int8Index(para.metric)
+    else:
+        index = bbannpy.UInt8Index(para.metric)
+    index.build(para)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (9, 11):
+        print("usage: build_sharded.py <data_type> <data_file> <index_path> "
+              "<metric_type> <K1> <hnswM> <hnswefC> <shard_num> "
+              "[--shard-id <id>]")
+        sys.exit(-1)
+    data_type, data_file, index_path, metric_type = sys.argv[1:5]
+    K1, hnswM, hnswefC, shard_num = [int(x) for x in sys.argv[5:9]]
+
+    if len(sys.argv) == 11:
+        build_shard(data_type, data_file, index_path, metric_type, K1, hnswM,
+                    hnswefC, shard_num, int(sys.argv[10]))
+        sys.exit(0)
+
+    procs = []
+    for shard_id in range(shard_num):
+        log = open("{0}build_shard_{1}.log".format(index_path, shard_id), "w")
+        procs.append(subprocess.Popen(
+            [sys.executable, __file__] + sys.argv[1:9] +
+            ["--shard-id", str(shard_id)], stdout=log, stderr=subprocess.STDOUT))
+    ret = 0
+    for shard_id, p in enumerate(procs):
+        if p.wait() != 0:
+            print("shard {0} failed with {1}".format(shard_id, p.returncode))
+            ret = 1
+    sys.exit(ret)
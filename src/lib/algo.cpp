@@ -1,12 +1,25 @@
 #include "lib/algo.h"
 #include "lib/ivf.h"
+#include "util/build_manifest.h"
 #include "util/constants.h"
+#include "util/deletion_bitmap.h"
 #include "util/file_handler.h"
 #include "util/statistics.h"
 #include "util/utils_inline.h"
+#include "util/work_stealing_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <numeric>
+#include <omp.h>
+#include <set>
 #include <thread>
+#include <unistd.h>
 
 namespace bbann {
 std::string Hello() { return "Hello!!!!"; }
@@ -39,21 +52,34 @@ void search_graph(std::shared_ptr<hnswlib::HierarchicalNSW<DISTT>> index_hnsw,
                   const int refine_nprobe, const DATAT *pquery,
                   uint32_t *buckets_label, float *centroids_dist) {
   bool set_distance = centroids_dist != nullptr;
-#pragma omp parallel for
-  for (int64_t i = 0; i < nq; i++) {
-    // move the duplicate logic into inner loop
-    // TODO optimize this
-    float *queryi_dist = set_distance ? centroids_dist + i * nprobe : nullptr;
-    auto reti = index_hnsw->searchKnn(pquery + i * dq, nprobe);
-    auto p_labeli = buckets_label + i * nprobe;
-    while (!reti.empty()) {
-      uint32_t cid, bid, offset;
-      bbann::util::parse_id(reti.top().second, cid, bid, offset);
-      *p_labeli++ = bbann::util::gen_global_block_id(cid, bid);
-      if (set_distance) {
-        *queryi_dist++ = reti.top().first;
+#pragma omp parallel
+  {
+    // per thread result buffers, reused by all the queries of the thread
+    std::vector<DISTT> dist(nprobe);
+    std::vector<hnswlib::labeltype> labels(nprobe);
+#pragma omp for
+    for (int64_t i = 0; i < nq; i++) {
+      auto n = index_hnsw->searchKnn(pquery + i * dq, nprobe, dist.data(),
+                                     labels.data());
+      auto p_labeli = buckets_label + i * nprobe;
+      float *queryi_dist = set_distance ? centroids_dist + i * nprobe : nullptr;
+      // nearest first
+      for (size_t j = 0; j < n; j++) {
+        uint32_t cid, bid, offset;
+        bbann::util::parse_id(labels[j], cid, bid, offset);
+        p_labeli[j] = bbann::util::gen_global_block_id(cid, bid);
+        if (set_distance) {
+          queryi_dist[j] = dist[j];
+        }
+      }
+      // fewer live nodes than nprobe, e.g. after compaction marked the nodes
+      // of emptied buckets deleted: the rest repeats the last bucket
+      for (size_t j = n; j < (size_t)nprobe; j++) {
+        p_labeli[j] = n > 0 ? p_labeli[n - 1] : 0;
+        if (set_distance) {
+          queryi_dist[j] = n > 0 ? queryi_dist[n - 1] : 0;
+        }
       }
-      reti.pop();
     }
   }
 }
@@ -77,8 +103,8 @@ void train_cluster(const std::string &raw_data_bin_file,
 
   *centroids = new float[K1 * dim];
   sample_data = new DATAT[sample_num * dim];
-  reservoir_sampling(raw_data_bin_file, sample_num, sample_data);
-  rc.RecordSection("reservoir sample with sample rate: " +
+  random_access_sampling(raw_data_bin_file, sample_num, sample_data);
+  rc.RecordSection("random access sample with sample rate: " +
                    std::to_string(K1_SAMPLE_RATE) + " done");
   double mxl, mnl;
   int64_t stat_n = std::min(static_cast<int64_t>(1000000), sample_num);
@@ -113,82 +139,218 @@ void train_cluster(const std::string &raw_data_bin_file,
   rc.ElapseFromBegin("train cluster done.");
 }
 
+// assign every vector of data_file to its nearest centroid and write it,
+// together with its id, to the data/ids file of that centroid. ids_file empty
+// means the ids are the row numbers in data_file. part_size returns the number
+// of vectors written to each output, block_size the number of vectors per
+// pipeline batch (4 batches are buffered).
+//
+// three-stage pipeline: while batch i is being assigned on the omp team,
+// batch i+1 is prefetched by a reader task and batch i-1 (already grouped by
+// centroid) is persisted by a writer task, one large write per output file.
 template <typename DATAT, typename DISTT>
-void divide_raw_data(const BBAnnParameters para, const float *centroids) {
-  TimeRecorder rc("divide raw data");
-  std::cout << "divide_raw_data parameters:" << std::endl;
-  std::cout << " raw_data_bin_file: " << para.dataFilePath
-            << " output_path: " << para.indexPrefixPath
-            << " centroids: " << centroids << " K1: " << para.K1 << std::endl;
-  int K1 = para.K1;
-  IOReader reader(para.dataFilePath);
-  uint32_t nb, dim;
+void partition_by_centroids(const std::string &data_file,
+                            const std::string &ids_file, const float *centroids,
+                            const int k,
+                            const std::vector<std::string> &data_files,
+                            const std::vector<std::string> &ids_files,
+                            std::vector<uint32_t> &part_size,
+                            const int64_t block_size = 1000000) {
+  IOReader reader(data_file);
+  std::unique_ptr<IOReader> ids_reader;
+  uint32_t nb, dim, ids_nb, ids_dim;
   reader.read((char *)&nb, sizeof(uint32_t));
   reader.read((char *)&dim, sizeof(uint32_t));
+  if (!ids_file.empty()) {
+    ids_reader = std::make_unique<IOReader>(ids_file);
+    ids_reader->read((char *)&ids_nb, sizeof(uint32_t));
+    ids_reader->read((char *)&ids_dim, sizeof(uint32_t));
+    assert(ids_nb == nb);
+    assert(ids_dim == 1);
+  }
   uint32_t placeholder = 0, const_one = 1;
-  std::vector<uint32_t> cluster_size(K1, 0);
-  std::vector<std::ofstream> cluster_dat_writer(K1);
-  std::vector<std::ofstream> cluster_ids_writer(K1);
-  for (int i = 0; i < K1; i++) {
-    cluster_dat_writer[i] = std::ofstream(
-        getClusterRawDataFileName(para.indexPrefixPath, i), std::ios::binary);
-    cluster_ids_writer[i] = std::ofstream(
-        getClusterGlobalIdsFileName(para.indexPrefixPath, i), std::ios::binary);
-    cluster_dat_writer[i].write((char *)&placeholder, sizeof(uint32_t));
-    cluster_dat_writer[i].write((char *)&dim, sizeof(uint32_t));
-    cluster_ids_writer[i].write((char *)&placeholder, sizeof(uint32_t));
-    cluster_ids_writer[i].write((char *)&const_one, sizeof(uint32_t));
-  }
-
-  int64_t block_size = 1000000;
-  assert(nb > 0);
-  int64_t block_num = (nb - 1) / block_size + 1;
+  part_size.assign(k, 0);
+  std::vector<std::ofstream> part_dat_writer(k);
+  std::vector<std::ofstream> part_ids_writer(k);
+  for (int i = 0; i < k; i++) {
+    part_dat_writer[i] = std::ofstream(data_files[i], std::ios::binary);
+    part_ids_writer[i] = std::ofstream(ids_files[i], std::ios::binary);
+    part_dat_writer[i].write((char *)&placeholder, sizeof(uint32_t));
+    part_dat_writer[i].write((char *)&dim, sizeof(uint32_t));
+    part_ids_writer[i].write((char *)&placeholder, sizeof(uint32_t));
+    part_ids_writer[i].write((char *)&const_one, sizeof(uint32_t));
+  }
+
+  int64_t block_num = nb == 0 ? 0 : (nb - 1) / block_size + 1;
   std::vector<int64_t> cluster_id(block_size);
   std::vector<DISTT> dists(block_size);
-  DATAT *block_buf = new DATAT[block_size * dim];
+  // the batches are used in place from the mapping of the input, the prefetch
+  // task pages them in. the ids are generated into block_ids when there is no
+  // ids file
+  std::vector<const DATAT *> block_bufs(2);
+  std::vector<const uint32_t *> block_ids(2);
+  std::unique_ptr<uint32_t[]> gen_ids;
+  if (!ids_reader) {
+    gen_ids = std::make_unique<uint32_t[]>(2 * block_size);
+  }
+  std::vector<std::unique_ptr<DATAT[]>> group_bufs(2);
+  std::vector<std::unique_ptr<uint32_t[]>> group_ids(2);
+  std::vector<std::vector<int64_t>> group_offsets(2,
+                                                  std::vector<int64_t>(k + 1));
+  for (int b = 0; b < 2; b++) {
+    group_bufs[b] = std::make_unique<DATAT[]>(block_size * dim);
+    group_ids[b] = std::make_unique<uint32_t[]>(block_size);
+  }
+
+  auto read_batch = [&](int64_t i) {
+    int64_t sp = i * block_size;
+    int64_t ep = std::min((int64_t)nb, sp + block_size);
+    block_bufs[i % 2] =
+        (const DATAT *)reader.fetch((ep - sp) * dim * sizeof(DATAT));
+    if (ids_reader) {
+      block_ids[i % 2] =
+          (const uint32_t *)ids_reader->fetch((ep - sp) * sizeof(uint32_t));
+    } else {
+      uint32_t *ids = gen_ids.get() + (i % 2) * block_size;
+      for (int64_t j = sp; j < ep; j++) {
+        ids[j - sp] = (uint32_t)j;
+      }
+      block_ids[i % 2] = ids;
+    }
+  };
+
+  auto write_batch = [&](int64_t i) {
+    const DATAT *gbuf = group_bufs[i % 2].get();
+    const uint32_t *gids = group_ids[i % 2].get();
+    const auto &offsets = group_offsets[i % 2];
+    for (int c = 0; c < k; c++) {
+      int64_t cnt = offsets[c + 1] - offsets[c];
+      if (cnt == 0) {
+        continue;
+      }
+      part_dat_writer[c].write((char *)(gbuf + offsets[c] * dim),
+                               cnt * dim * sizeof(DATAT));
+      part_ids_writer[c].write((char *)(gids + offsets[c]),
+                               cnt * sizeof(uint32_t));
+      part_size[c] += cnt;
+    }
+  };
+
+  std::future<void> read_future;
+  if (block_num > 0) {
+    read_future = std::async(std::launch::async, read_batch, 0);
+  }
+  std::future<void> write_future;
   for (int64_t i = 0; i < block_num; i++) {
     TimeRecorder rci("batch-" + std::to_string(i));
     int64_t sp = i * block_size;
     int64_t ep = std::min((int64_t)nb, sp + block_size);
+    int64_t n = ep - sp;
     std::cout << "split the " << i << "th batch, start position = " << sp
               << ", end position = " << ep << std::endl;
-    reader.read((char *)block_buf, (ep - sp) * dim * sizeof(DATAT));
+    read_future.get();
+    if (i + 1 < block_num) {
+      read_future = std::async(std::launch::async, read_batch, i + 1);
+    }
     rci.RecordSection("read batch data done");
 
-    elkan_L2_assign<DATAT, float, DISTT>(block_buf, centroids, dim, ep - sp, K1,
-                                         cluster_id.data(), dists.data());
+    const DATAT *block_buf = block_bufs[i % 2];
+    const uint32_t *block_id = block_ids[i % 2];
+    blocked_L2_assign<DATAT, DISTT>(block_buf, centroids, dim, n, k,
+                                    cluster_id.data(), dists.data());
     rci.RecordSection("select file done");
-    for (int64_t j = 0; j < ep - sp; j++) {
-      int64_t cid = cluster_id[j];
-      uint32_t uid = (uint32_t)(j + sp);
-      cluster_dat_writer[cid].write((char *)(block_buf + j * dim),
-                                    sizeof(DATAT) * dim);
-      cluster_ids_writer[cid].write((char *)&uid, sizeof(uint32_t));
-      cluster_size[cid]++;
-    }
-    rci.RecordSection("write done");
+
+    // group the batch by cluster id. every thread counts its own contiguous
+    // range first, so the scatter keeps the original order within a cluster.
+    DATAT *gbuf = group_bufs[i % 2].get();
+    uint32_t *gids = group_ids[i % 2].get();
+    auto &offsets = group_offsets[i % 2];
+    std::vector<int64_t> thread_pos((int64_t)omp_get_max_threads() * k, 0);
+#pragma omp parallel
+    {
+      int nt = omp_get_num_threads();
+      int rank = omp_get_thread_num();
+      int64_t j0 = n * rank / nt;
+      int64_t j1 = n * (rank + 1) / nt;
+      int64_t *pos = thread_pos.data() + (int64_t)rank * k;
+      for (int64_t j = j0; j < j1; j++) {
+        pos[cluster_id[j]]++;
+      }
+#pragma omp barrier
+#pragma omp single
+      {
+        int64_t acc = 0;
+        for (int c = 0; c < k; c++) {
+          offsets[c] = acc;
+          for (int t = 0; t < nt; t++) {
+            int64_t cnt = thread_pos[(int64_t)t * k + c];
+            thread_pos[(int64_t)t * k + c] = acc;
+            acc += cnt;
+          }
+        }
+        offsets[k] = acc;
+      }
+      for (int64_t j = j0; j < j1; j++) {
+        int64_t dst = pos[cluster_id[j]]++;
+        memcpy(gbuf + dst * dim, block_buf + j * dim, sizeof(DATAT) * dim);
+        gids[dst] = block_id[j];
+      }
+    }
+    rci.RecordSection("group by cluster done");
+
+    if (write_future.valid()) {
+      write_future.get();
+    }
+    write_future = std::async(std::launch::async, write_batch, i);
     rci.ElapseFromBegin("split batch " + std::to_string(i) + " done");
   }
+  if (write_future.valid()) {
+    write_future.get();
+  }
+
+  for (int i = 0; i < k; i++) {
+    uint32_t cis = part_size[i];
+    part_dat_writer[i].seekp(0);
+    part_dat_writer[i].write((char *)&cis, sizeof(uint32_t));
+    part_dat_writer[i].close();
+    part_ids_writer[i].seekp(0);
+    part_ids_writer[i].write((char *)&cis, sizeof(uint32_t));
+    part_ids_writer[i].close();
+  }
+}
+
+template <typename DATAT, typename DISTT>
+void divide_raw_data(const BBAnnParameters para, const float *centroids) {
+  TimeRecorder rc("divide raw data");
+  std::cout << "divide_raw_data parameters:" << std::endl;
+  std::cout << " raw_data_bin_file: " << para.dataFilePath
+            << " output_path: " << para.indexPrefixPath
+            << " centroids: " << centroids << " K1: " << para.K1 << std::endl;
+  int K1 = para.K1;
+  std::vector<std::string> data_files(K1), ids_files(K1);
+  for (int i = 0; i < K1; i++) {
+    data_files[i] = getClusterRawDataFileName(para.indexPrefixPath, i);
+    ids_files[i] = getClusterGlobalIdsFileName(para.indexPrefixPath, i);
+  }
+  std::vector<uint32_t> cluster_size;
+  partition_by_centroids<DATAT, DISTT>(para.dataFilePath, "", centroids, K1,
+                                       data_files, ids_files, cluster_size);
+  // the build manifest marks the stage done next
+  for (int i = 0; i < K1; i++) {
+    util::sync_file(data_files[i]);
+    util::sync_file(ids_files[i]);
+  }
   rc.RecordSection("split done");
   size_t sump = 0;
   std::cout << "split_raw_data done in ... seconds, show statistics:"
             << std::endl;
   for (int i = 0; i < K1; i++) {
-    uint32_t cis = cluster_size[i];
-    cluster_dat_writer[i].seekp(0);
-    cluster_dat_writer[i].write((char *)&cis, sizeof(uint32_t));
-    cluster_dat_writer[i].close();
-    cluster_ids_writer[i].seekp(0);
-    cluster_ids_writer[i].write((char *)&cis, sizeof(uint32_t));
-    cluster_ids_writer[i].close();
-    std::cout << "cluster-" << i << " has " << cis << " points." << std::endl;
-    sump += cis;
-  }
-  rc.RecordSection("rewrite header done");
+    std::cout << "cluster-" << i << " has " << cluster_size[i] << " points."
+              << std::endl;
+    sump += cluster_size[i];
+  }
   std::cout << "total points num: " << sump << std::endl;
 
-  delete[] block_buf;
-  block_buf = nullptr;
   rc.ElapseFromBegin("split_raw_data totally done");
 }
 
@@ -289,6 +451,50 @@ inline void read_bin_file_half_dimension(const std::string &file_name, T *&data,
   }
 }
 
+// k-level scalar quantizer of n values: lloyd iterations on the sorted
+// values, started from the quantiles. a cell is a contiguous range so its
+// mean comes from prefix sums. lloyd stops at a local optimum of the squared
+// error, not necessarily the optimal quantizer. sorts x in place. codes is
+// sorted on return.
+static void train_1d_codebook(float *x, const int64_t n, const int k,
+                              float *codes, const int niter = 50) {
+  if (n == 0) {
+    std::fill(codes, codes + k, 0.0f);
+    return;
+  }
+  std::sort(x, x + n);
+  std::vector<double> prefix(n + 1, 0);
+  for (int64_t i = 0; i < n; i++) {
+    prefix[i + 1] = prefix[i] + x[i];
+  }
+  // start from the quantiles
+  for (int j = 0; j < k; j++) {
+    codes[j] = x[std::min<int64_t>(n - 1, (2 * j + 1) * n / (2 * k))];
+  }
+  std::vector<int64_t> bound(k + 1);
+  bound[0] = 0;
+  bound[k] = n;
+  for (int iter = 0; iter < niter; iter++) {
+    for (int j = 1; j < k; j++) {
+      float mid = (codes[j - 1] + codes[j]) / 2;
+      bound[j] = std::upper_bound(x, x + n, mid) - x;
+    }
+    bool changed = false;
+    for (int j = 0; j < k; j++) {
+      int64_t cnt = bound[j + 1] - bound[j];
+      if (cnt == 0) {
+        continue;
+      }
+      float c = (prefix[bound[j + 1]] - prefix[bound[j]]) / cnt;
+      changed |= (c != codes[j]);
+      codes[j] = c;
+    }
+    if (!changed) {
+      break;
+    }
+  }
+}
+
 void build_hnsw_sq(const std::string &index_path, const int hnswM,
                    const int hnswefC, MetricType metric_type) {
   TimeRecorder rc("create_graph_index");
@@ -305,27 +511,35 @@ void build_hnsw_sq(const std::string &index_path, const int hnswM,
 
   float *codes = new float[256 * ndim];
   uint8_t *codebook = new uint8_t[(uint64_t)total_n * (uint64_t)ndim];
-  memset(codebook, 0, sizeof(uint8_t) * (uint64_t)total_n * (uint64_t)ndim);
   uint64_t sample_size = total_n * 0.01;
   float *sample_data = new float[ndim * sample_size];
   random_sampling_k2(pdata, total_n, ndim, sample_size, sample_data);
-  float temp;
-  // #pragma omp parallel for
-  for (int i = 0; i < sample_size; i++) {
-    for (int j = i; j < ndim; j++) {
-      temp = sample_data[sample_size * j + i];
-      sample_data[sample_size * j + i] = sample_data[i * ndim + j];
-      sample_data[i * ndim + j] = temp;
+
+  // transpose the sample to one contiguous row per dimension
+  std::unique_ptr<float[]> sample_t(new float[ndim * sample_size]);
+  const int64_t tile = 64;
+#pragma omp parallel for collapse(2) schedule(static)
+  for (int64_t i0 = 0; i0 < (int64_t)sample_size; i0 += tile) {
+    for (int64_t j0 = 0; j0 < (int64_t)ndim; j0 += tile) {
+      int64_t i1 = std::min<int64_t>(i0 + tile, sample_size);
+      int64_t j1 = std::min<int64_t>(j0 + tile, ndim);
+      for (int64_t j = j0; j < j1; j++) {
+        for (int64_t i = i0; i < i1; i++) {
+          sample_t[j * sample_size + i] = sample_data[i * ndim + j];
+        }
+      }
     }
   }
+  delete[] sample_data;
 
-  for (uint32_t i = 0; i < ndim; ++i) {
-    // std::cout<<"training the dim :     "<<i<<std::endl;
-    kmeans(sample_size, sample_data + i * sample_size, 1, 256,
-           (float *)(codes + i * 256));
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int64_t d = 0; d < (int64_t)ndim; ++d) {
+    train_1d_codebook(sample_t.get() + d * sample_size, sample_size, 256,
+                      codes + d * 256);
   }
-  // std::cout<<"training kmeans down    "<<std::endl;
-  delete[] sample_data;
+  sample_t.reset();
+  rc.RecordSection("train codebook of " + std::to_string(ndim) +
+                   " dims done");
 
 #pragma omp parallel for
   for (auto d = 0; d < ndim; d++) {
@@ -333,22 +547,32 @@ void build_hnsw_sq(const std::string &index_path, const int hnswM,
     std::sort(d_code, d_code + 256);
   }
 
-#pragma omp parallel for
-  for (auto i = 0; i < total_n; i++) {
-    auto *x_codebook = codebook + i * ndim;
-    for (auto d = 0; d < ndim; d++) {
-      auto *x_code = codes + 256 * d;
-      auto pos =
-          std::lower_bound(x_code, x_code + 256, pdata[i * ndim + d]) - x_code;
-      if (pos == 256) {
-        x_codebook[d] = 255;
-      } else if (pos == 0) {
-        x_codebook[d] = 0;
-      } else {
-        x_codebook[d] = (std::abs(x_code[pos - 1] - pdata[i * ndim + d]) <
-                                 std::abs(x_code[pos] - pdata[i * ndim + d])
-                             ? pos - 1
-                             : pos);
+  // encode a tile of rows a few dims at a time, the codes of those dims stay
+  // in L1 across the rows of the tile
+  const int64_t row_tile = 256;
+  const int64_t dim_tile = 16;
+#pragma omp parallel for schedule(static)
+  for (int64_t i0 = 0; i0 < (int64_t)total_n; i0 += row_tile) {
+    int64_t i1 = std::min<int64_t>(i0 + row_tile, total_n);
+    for (int64_t d0 = 0; d0 < (int64_t)ndim; d0 += dim_tile) {
+      int64_t d1 = std::min<int64_t>(d0 + dim_tile, ndim);
+      for (int64_t i = i0; i < i1; i++) {
+        auto *x_codebook = codebook + i * ndim;
+        const float *x = pdata + i * ndim;
+        for (int64_t d = d0; d < d1; d++) {
+          auto *x_code = codes + 256 * d;
+          auto pos = std::lower_bound(x_code, x_code + 256, x[d]) - x_code;
+          if (pos == 256) {
+            x_codebook[d] = 255;
+          } else if (pos == 0) {
+            x_codebook[d] = 0;
+          } else {
+            x_codebook[d] = (std::abs(x_code[pos - 1] - x[d]) <
+                                     std::abs(x_code[pos] - x[d])
+                                 ? pos - 1
+                                 : pos);
+          }
+        }
       }
     }
   }
@@ -379,6 +603,7 @@ void build_hnsw_sq(const std::string &index_path, const int hnswM,
   std::cout << "hnsw totally add " << npts << " points" << std::endl;
   rc.RecordSection("create index hnsw done");
   index_hnsw->saveIndex(index_path + HNSW + INDEX + BIN);
+  util::sync_file(index_path + HNSW + INDEX + BIN);
   rc.RecordSection("hnsw save index done");
   delete[] pids;
   pids = nullptr;
@@ -427,123 +652,116 @@ void build_graph(const std::string &index_path, const int hnswM,
   const uint32_t vec_size = sizeof(DATAT) * ndim;
   const uint32_t entry_size = vec_size + sizeof(uint32_t);
 
-  auto index_hnsw = std::make_shared<hnswlib::HierarchicalNSW<DISTT>>(
-      space, sample * nblocks, hnswM, hnswefC);
-  uint32_t cid0, bid0;
-  bbann::util::parse_global_block_id(pids[0], cid0, bid0);
-  // add centroids
-  index_hnsw->addPoint(pdata, bbann::util::gen_id(cid0, bid0, 0));
-  if (sample != 1) {
-    // add sample data
-    std::string cluster_file_path =
-        index_path + CLUSTER + std::to_string(cid0) + "-" + RAWDATA + BIN;
-    auto fh = std::ifstream(cluster_file_path, std::ios::binary);
-    assert(!fh.fail());
-    char *buf = new char[block_size];
-    fh.seekg(bid0 * block_size);
-    fh.read(buf, block_size);
-    const uint32_t entry_num = *reinterpret_cast<uint32_t *>(buf);
-    int bucketSample = sample - 1;
-    if (bucketSample > entry_num) {
-      bucketSample = entry_num;
-    }
-    char *buf_begin = buf + sizeof(uint32_t);
-
-    // calculate all vectors distance to centroid
-    DISTT *distance = new DISTT[entry_num];
-    for (uint32_t j = 0; j < entry_num; ++j) {
-      char *entry_begin = buf_begin + entry_size * j;
-      distance[j] =
-          dis_computer(reinterpret_cast<DATAT *>(entry_begin), pdata, ndim);
-    }
-
-    // for top distance samples distance
-    std::unordered_set<int> indices;
-    for (uint32_t j = 0; j < bucketSample; j++) {
-      int32_t picked = -1;
-      for (uint32_t k = 0; k < entry_num; k++) {
-        if (indices.find(k) != indices.end()) {
-          // already picked
-          continue;
-        }
-        if (picked == -1 || pickFurther ? (distance[k] > distance[picked])
-                                        : (distance[k] < distance[picked])) {
-          picked = k;
-        }
+  // pick the sample - 1 entries furthest from the centroid of every bucket
+  // into an in-memory array before the graph build. the blocks of a K1
+  // cluster are laid out by bid, so each cluster file is streamed once in
+  // large sequential reads.
+  const int32_t bucket_sample = std::max(0, sample - 1);
+  std::unique_ptr<DATAT[]> sample_data;
+  std::vector<uint32_t> sample_num(nblocks, 0);
+  if (bucket_sample > 0) {
+    sample_data.reset(new DATAT[(uint64_t)nblocks * bucket_sample * ndim]);
+
+    // bucket index in pdata of every (cid, bid)
+    std::vector<std::vector<int64_t>> bucket_index;
+    for (int64_t i = 0; i < nblocks; i++) {
+      uint32_t cid, bid;
+      bbann::util::parse_global_block_id(pids[i], cid, bid);
+      if (cid >= bucket_index.size()) {
+        bucket_index.resize(cid + 1);
       }
-      if (picked == -1) {
-        break;
+      if (bid >= bucket_index[cid].size()) {
+        bucket_index[cid].resize(bid + 1, -1);
       }
-      indices.insert(picked);
-      char *entry_begin = buf_begin + entry_size * picked;
-      index_hnsw->addPoint(reinterpret_cast<DATAT *>(entry_begin),
-                           bbann::util::gen_id(cid0, bid0, j + 1));
+      bucket_index[cid][bid] = i;
     }
-    delete[] distance;
-    delete[] buf;
-    fh.close();
-  }
-#pragma omp parallel for
-  for (int64_t i = 1; i < nblocks; i++) {
-    uint32_t cid, bid;
-    bbann::util::parse_global_block_id(pids[i], cid, bid);
-    index_hnsw->addPoint(pdata + i * ndim, bbann::util::gen_id(cid, bid, 0));
-    if (sample != 1) {
-      // add sample data
-      std::string cluster_file_path =
-          index_path + CLUSTER + std::to_string(cid) + "-" + RAWDATA + BIN;
-      auto fh = std::ifstream(cluster_file_path, std::ios::binary);
+
+    const int64_t blocks_per_read =
+        std::max<int64_t>(1, 16 * ioreader::MEGABYTE / block_size);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int64_t cid = 0; cid < (int64_t)bucket_index.size(); cid++) {
+      const auto &index = bucket_index[cid];
+      if (index.empty()) {
+        continue;
+      }
+      std::ifstream fh(getClusterRawDataFileName(index_path, cid),
+                       std::ios::binary);
       assert(!fh.fail());
-      char *buf = new char[block_size];
-      fh.seekg(bid * block_size);
-      fh.read(buf, block_size);
-      const uint32_t entry_num = *reinterpret_cast<uint32_t *>(buf);
-      int bucketSample = sample - 1;
-      if (bucketSample > entry_num) {
-        bucketSample = entry_num;
-      }
-      char *buf_begin = buf + sizeof(uint32_t);
-
-      // calculate all distance to centroid
-      DISTT *distance = new DISTT[entry_num];
-      for (uint32_t j = 0; j < entry_num; ++j) {
-        char *entry_begin = buf_begin + entry_size * j;
-        distance[j] = dis_computer(reinterpret_cast<DATAT *>(entry_begin),
-                                   pdata + i * ndim, ndim);
-      }
-
-      // for top distance samples distance
-      std::unordered_set<int> indices;
-      for (uint32_t j = 0; j < bucketSample; j++) {
-        int32_t picked = -1;
-        DISTT pickedDistance;
-        for (uint32_t k = 0; k < entry_num; k++) {
-          if (indices.find(k) != indices.end()) {
-            // already picked
+      std::vector<char> buf(blocks_per_read * block_size);
+      std::vector<DISTT> distance;
+      std::vector<uint32_t> order;
+      for (int64_t bid0 = 0; bid0 < (int64_t)index.size();
+           bid0 += blocks_per_read) {
+        int64_t nread =
+            std::min<int64_t>(blocks_per_read, index.size() - bid0);
+        fh.read(buf.data(), nread * block_size);
+        assert(!fh.fail());
+        for (int64_t b = 0; b < nread; b++) {
+          int64_t i = index[bid0 + b];
+          if (i < 0) {
             continue;
           }
-          if (picked == -1 || pickFurther ? (distance[k] > distance[picked])
-                                          : (distance[k] < distance[picked])) {
-            picked = k;
+          const char *blk = buf.data() + b * block_size;
+          const uint32_t entry_num = *reinterpret_cast<const uint32_t *>(blk);
+          const char *buf_begin = blk + sizeof(uint32_t);
+          uint32_t picked = std::min<uint32_t>(bucket_sample, entry_num);
+
+          distance.resize(entry_num);
+          order.resize(entry_num);
+          for (uint32_t j = 0; j < entry_num; ++j) {
+            distance[j] = dis_computer(
+                reinterpret_cast<const DATAT *>(buf_begin + entry_size * j),
+                pdata + i * ndim, ndim);
+            order[j] = j;
           }
+          auto further = [&](uint32_t x, uint32_t y) {
+            return pickFurther ? distance[x] > distance[y]
+                               : distance[x] < distance[y];
+          };
+          std::nth_element(order.begin(), order.begin() + picked, order.end(),
+                           further);
+          std::sort(order.begin(), order.begin() + picked, further);
+
+          DATAT *dst = sample_data.get() + (uint64_t)i * bucket_sample * ndim;
+          for (uint32_t j = 0; j < picked; j++) {
+            memcpy(dst + j * ndim, buf_begin + entry_size * order[j],
+                   vec_size);
+          }
+          sample_num[i] = picked;
         }
-        if (picked == -1) {
-          break;
-        }
-        indices.insert(picked);
-        char *entry_begin = buf_begin + entry_size * picked;
-        index_hnsw->addPoint(reinterpret_cast<DATAT *>(entry_begin),
-                             bbann::util::gen_id(cid, bid, j + 1));
       }
-      delete[] distance;
-      delete[] buf;
-      fh.close();
     }
+    rc.RecordSection("pick " + std::to_string(bucket_sample) +
+                     " samples of every bucket done");
+  }
+
+  auto index_hnsw = std::make_shared<hnswlib::HierarchicalNSW<DISTT>>(
+      space, sample * nblocks, hnswM, hnswefC);
+  auto add_bucket = [&](int64_t i) {
+    uint32_t cid, bid;
+    bbann::util::parse_global_block_id(pids[i], cid, bid);
+    index_hnsw->addPoint(pdata + i * ndim, bbann::util::gen_id(cid, bid, 0));
+    const DATAT *samples =
+        sample_data.get() + (uint64_t)i * bucket_sample * ndim;
+    for (uint32_t j = 0; j < sample_num[i]; j++) {
+      index_hnsw->addPoint(samples + j * ndim,
+                           bbann::util::gen_id(cid, bid, j + 1));
+    }
+  };
+  // the first bucket goes in alone, it sets the entry point
+  add_bucket(0);
+#pragma omp parallel for
+  for (int64_t i = 1; i < nblocks; i++) {
+    add_bucket(i);
   }
   std::cout << "hnsw totally add " << sample * nblocks << " points"
             << std::endl;
   rc.RecordSection("create index hnsw done");
+  // the parallel inserts scatter neighbours over the whole graph
+  index_hnsw->reorderGraph();
+  rc.RecordSection("reorder hnsw graph done");
   index_hnsw->saveIndex(index_path + HNSW + INDEX + BIN);
+  util::sync_file(index_path + HNSW + INDEX + BIN);
   rc.RecordSection("hnsw save index done");
   delete[] pdata;
   pdata = nullptr;
@@ -566,24 +784,164 @@ void reservoir_sampling(const std::string &data_file, const size_t sample_num,
   reader.read((char *)&dim, sizeof(uint32_t));
   ntotal = nb;
   ndims = dim;
-  std::unique_ptr<T[]> tmp_buf = std::make_unique<T[]>(ndims);
   for (size_t i = 0; i < sample_num; i++) {
     auto pi = sample_data + ndims * i;
     reader.read((char *)pi, ndims * sizeof(T));
   }
   for (size_t i = sample_num; i < ntotal; i++) {
-    reader.read((char *)tmp_buf.get(), ndims * sizeof(T));
+    const char *row = reader.view(ndims * sizeof(T));
     std::uniform_int_distribution<size_t> distribution(0, i);
     size_t rand = (size_t)distribution(generator);
     if (rand < sample_num) {
-      memcpy((char *)(sample_data + ndims * rand), tmp_buf.get(),
-             ndims * sizeof(T));
+      memcpy((char *)(sample_data + ndims * rand), row, ndims * sizeof(T));
     }
   }
 }
 
+// pick sample_num distinct rows up front and fetch only those rows with
+// parallel pread, merging rows that are close in the file into one read.
+template <typename T>
+void random_access_sampling(const std::string &data_file,
+                            const size_t sample_num, T *sample_data) {
+  assert(sample_data != nullptr);
+  uint32_t nb, dim;
+  util::get_bin_metadata(data_file, nb, dim);
+  assert(sample_num <= nb);
+  const uint64_t row_size = sizeof(T) * (uint64_t)dim;
+  const uint64_t header_size = 2 * sizeof(uint32_t);
+
+  // draw a little more than needed, drop duplicates, then cut back to
+  // sample_num with a shuffle so the kept rows stay uniform.
+  std::random_device rd;
+  std::mt19937_64 generator(rd());
+  std::uniform_int_distribution<uint64_t> distribution(0, nb - 1);
+  std::vector<uint64_t> rows;
+  rows.reserve(sample_num + sample_num / 64 + 16);
+  while (rows.size() < sample_num) {
+    size_t need = sample_num - rows.size();
+    for (size_t i = 0; i < need + need / 64 + 16; i++) {
+      rows.push_back(distribution(generator));
+    }
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+  }
+  std::shuffle(rows.begin(), rows.end(), generator);
+  rows.resize(sample_num);
+  std::sort(rows.begin(), rows.end());
+  // the rows are fetched in file order, each lands in a random slot of the
+  // sample so that a prefix of it is a uniform sample too
+  std::vector<size_t> slot(sample_num);
+  std::iota(slot.begin(), slot.end(), 0);
+  std::shuffle(slot.begin(), slot.end(), generator);
+
+  // coalesce rows whose gap is small enough that one read beats two.
+  const uint64_t max_gap = 64 * KILOBYTE;
+  const uint64_t max_range = 4 * MEGABYTE;
+  std::vector<std::pair<size_t, size_t>> ranges; // [first, last) in rows
+  for (size_t i = 0; i < sample_num;) {
+    size_t j = i + 1;
+    while (j < sample_num &&
+           (rows[j] - rows[j - 1] - 1) * row_size <= max_gap &&
+           (rows[j] - rows[i] + 1) * row_size <= max_range) {
+      j++;
+    }
+    ranges.emplace_back(i, j);
+    i = j;
+  }
+
+  int fd = open(data_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cout << "open() failed, file: " << data_file << ", errno: " << errno
+              << ", error: " << strerror(errno) << std::endl;
+    exit(-1);
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+#pragma omp parallel
+  {
+    std::vector<char> buf;
+#pragma omp for schedule(dynamic, 64)
+    for (size_t r = 0; r < ranges.size(); r++) {
+      const size_t first = ranges[r].first;
+      const size_t last = ranges[r].second;
+      const uint64_t begin = header_size + rows[first] * row_size;
+      const uint64_t len = (rows[last - 1] - rows[first] + 1) * row_size;
+      buf.resize(len);
+      uint64_t done = 0;
+      while (done < len) {
+        auto ret = pread(fd, buf.data() + done, len - done, begin + done);
+        if (ret <= 0) {
+          std::cout << "pread() failed, file: " << data_file
+                    << ", offset: " << begin + done << ", errno: " << errno
+                    << std::endl;
+          exit(-1);
+        }
+        done += ret;
+      }
+      for (size_t i = first; i < last; i++) {
+        memcpy(sample_data + slot[i] * dim,
+               buf.data() + (rows[i] - rows[first]) * row_size, row_size);
+      }
+    }
+  }
+  close(fd);
+}
+
+// output of one K1 cluster: the blocks are written to a side file that
+// replaces the raw data file of the cluster when it is done, the centroids
+// and ids of the buckets to side files concatenated into the bucket files at
+// the end. a clustering task reserves the next block index and writes at the
+// offsets of that index. shared by all partitions of a cluster split out of
+// core, on_done runs when the last of them finishes and the files are closed.
+struct K1ClusterOutput {
+  uint32_t cid = 0;
+  std::unique_ptr<PositionalWriter> data_writer;
+  std::unique_ptr<PositionalWriter> centroids_writer;
+  std::unique_ptr<PositionalWriter> centroids_id_writer;
+  std::atomic<uint32_t> blk_num{0};
+  std::function<void()> on_done;
+
+  ~K1ClusterOutput() {
+    data_writer.reset();
+    centroids_writer.reset();
+    centroids_id_writer.reset();
+    if (on_done) {
+      on_done();
+    }
+  }
+};
+
+// state of one K1 cluster (or one on-disk partition of it) while its
+// clustering tasks are in the pool, the buffers are released as soon as the
+// last task finishes.
+template <typename DATAT> struct K1ClusterContext {
+  std::shared_ptr<K1ClusterOutput> output;
+  int64_t data_size = 0;
+  uint64_t footprint = 0;
+  std::unique_ptr<DATAT[]> data;
+  std::unique_ptr<uint32_t[]> ids;
+  std::atomic<int64_t> pending{0};
+
+  void release() {
+    data.reset();
+    ids.reset();
+    output.reset();
+  }
+};
+
+// a data/ids file pair waiting to be clustered, either the file of a K1
+// cluster written by divide_raw_data or an on-disk partition of it.
+struct K1ClusterInput {
+  uint32_t cid = 0;
+  std::string data_file;
+  std::string ids_file;
+  std::shared_ptr<K1ClusterOutput> output; // null for a K1 cluster file
+  bool splittable = true;
+};
+
 template <typename DATAT, typename DISTT>
-void hierarchical_clusters(const BBAnnParameters para, const double avg_len) {
+void hierarchical_clusters(const BBAnnParameters para, const double avg_len,
+                           BuildManifest *manifest) {
 
   TimeRecorder rc("hierarchical clusters");
   std::cout << "hierarchical clusters parameters:" << std::endl;
@@ -599,11 +957,16 @@ void hierarchical_clusters(const BBAnnParameters para, const double avg_len) {
       para.indexPrefixPath + "bucket-centroids.bin";
   std::string bucket_centroids_id_file =
       para.indexPrefixPath + "cluster-combine_ids.bin";
-  uint32_t placeholder = 1;
-  uint32_t global_centroids_number = 0;
+  if (para.shardNum > 1) {
+    // merged by merge_bucket_shards once all the shards are done
+    bucket_centroids_file = getShardFileName(bucket_centroids_file, para.shardId);
+    bucket_centroids_id_file =
+        getShardFileName(bucket_centroids_id_file, para.shardId);
+  }
   uint32_t centroids_dim = 0;
-  util::get_bin_metadata(getClusterRawDataFileName(para.indexPrefixPath, 0),
-                         cluster_size, cluster_dim);
+  // the raw data file of a finished cluster holds blocks, take the dimension
+  // from the input
+  util::get_bin_metadata(para.dataFilePath, cluster_size, cluster_dim);
 
   std::vector<DATAT> max_len(cluster_dim);
   std::vector<DATAT> min_len(cluster_dim);
@@ -616,162 +979,156 @@ void hierarchical_clusters(const BBAnnParameters para, const double avg_len) {
     meta_reader.read((char *)min_len.data(), sizeof(DATAT) * cluster_dim);
   }
 
-  {
-    IOWriter centroids_writer(bucket_centroids_file);
-    IOWriter centroids_id_writer(bucket_centroids_id_file);
-    centroids_writer.write((char *)&placeholder, sizeof(uint32_t));
-    centroids_writer.write((char *)&placeholder, sizeof(uint32_t));
-    centroids_id_writer.write((char *)&placeholder, sizeof(uint32_t));
-    centroids_id_writer.write((char *)&placeholder, sizeof(uint32_t));
-
-    int64_t global_start_position = centroids_id_writer.get_position();
-    assert(global_start_position != -1);
-    // std::cout << "global_centroids_number: global_start_position: "
-    //           << global_start_position << std::endl;
-
-    for (uint32_t i = 0; i < K1; i++) {
-      TimeRecorder rci("train-cluster-" + std::to_string(i));
-
-      int64_t local_start_position = centroids_id_writer.get_position();
-      assert(local_start_position != -1);
-      // std::cout << "global_centroids_number: local_start_position: "
-      //           << local_start_position << std::endl;
-
-      IOReader data_reader(getClusterRawDataFileName(para.indexPrefixPath, i));
-      IOReader ids_reader(getClusterGlobalIdsFileName(para.indexPrefixPath, i));
-
-      data_reader.read((char *)&cluster_size, sizeof(uint32_t));
-      data_reader.read((char *)&cluster_dim, sizeof(uint32_t));
-      ids_reader.read((char *)&ids_size, sizeof(uint32_t));
-      ids_reader.read((char *)&ids_dim, sizeof(uint32_t));
-
-      if (para.vector_use_sq) {
-        entry_num =
-            (para.blockSize - sizeof(uint32_t)) /
-            (cluster_dim * sizeof(uint8_t) + ids_dim * sizeof(uint32_t));
-      } else {
-        entry_num = (para.blockSize - sizeof(uint32_t)) /
-                    (cluster_dim * sizeof(DATAT) + ids_dim * sizeof(uint32_t));
-      }
-
-      centroids_dim = cluster_dim;
-      assert(cluster_size == ids_size);
-      assert(ids_dim == 1);
-      assert(entry_num > 0);
-
-      int64_t data_size = static_cast<int64_t>(cluster_size);
-      // std::cout << "train cluster" << std::to_string(i) << "data files" <<
-      // data_file << "size" << data_size << std::endl;
-      DATAT *datai = new DATAT[data_size * cluster_dim * 1ULL];
-
-      uint32_t *idi = new uint32_t[ids_size * ids_dim];
-      uint32_t blk_num = 0;
-      data_reader.read((char *)datai, data_size * cluster_dim * sizeof(DATAT));
-      ids_reader.read((char *)idi, ids_size * ids_dim * sizeof(uint32_t));
-
-      IOWriter data_writer(getClusterRawDataFileName(para.indexPrefixPath, i),
-                           ioreader::MEGABYTE * 100);
-
-      // recursive style
-      // recursive_kmeans<DATAT>(i, data_size, datai, idi, cluster_dim,
-      //                         entry_num, blk_size, blk_num, data_writer,
-      //                         centroids_writer, centroids_id_writer, 0,
-      //                         false, avg_len);
-
-      // non-recursive style
-      std::list<struct ClusteringTask> todo;
-      std::mutex todo_mutex;
-      ClusteringTask init{0, data_size, 0};
-      todo.push_back(init);
-      std::mutex mutex;
-
-      while (not todo.empty()) {
-        std::vector<ClusteringTask> output_tasks;
-
-        auto cur = todo.front();
-
-        if (LevelType(cur.level) >= LevelType::BALANCE_LEVEL) {
-          // std::cout << "non_recursive_multilevel_kmeans: "
-          //           << "balance level, to parallel" << std::endl;
-          break;
-        }
-
-        todo.pop_front();
-
-        // std::cout << "non_recursive_multilevel_kmeans: "
-        //           << " cur.offset:" << cur.offset
-        //           << " cur.num_elems:" << cur.num_elems
-        //           << " cur.level:" << cur.level << std::endl;
-        non_recursive_multilevel_kmeans<DATAT>(
-            i,              // the index of k1 round k-means
-            cur.num_elems,  // number vectors in this cluster
-            datai,          // buffer to place all vectors
-            idi,            // buffer to place all ids
-            cur.offset,     // the offset of to clustering data in this round
-            cluster_dim,    // the dimension of vector
-            entry_num,      // threshold, determines when to stop recursive
-                            // clustering
-            para.blockSize, // general 4096, determines how many vectors can be
-                            // placed in a block
-            blk_num,     // output variable, number block output in this round
-                         // clustering
-            data_writer, // file writer 1: to output base vectors
-            centroids_writer,     // file writer 2: to output centroid vectors
-            centroids_id_writer,  // file writer 3: to output centroid ids
-            local_start_position, // the start position of all centroids id
-            cur.level,          // n-th round recursive clustering, start with 0
-            mutex,              // mutext to protect write out centroids
-            output_tasks,       // output clustering tasks
-            para.vector_use_sq, // whether use scalar quantization on base
-                                // vector
-            max_len,            // the max values in each dimension
-            min_len,            // the min values in each dimension
-            false,              // k-means parameter
-            avg_len             // k-means parameter
-        );
-
-        for (auto &output_task : output_tasks) {
-          todo.push_back(output_task);
-        }
+  if (para.vector_use_sq) {
+    entry_num = (para.blockSize - sizeof(uint32_t)) /
+                (cluster_dim * sizeof(uint8_t) + sizeof(uint32_t));
+  } else {
+    entry_num = (para.blockSize - sizeof(uint32_t)) /
+                (cluster_dim * sizeof(DATAT) + sizeof(uint32_t));
+  }
+  assert(entry_num > 0);
+  centroids_dim = cluster_dim;
+
+  const uint64_t centroid_size = centroids_dim * sizeof(DATAT);
+
+  // side files of the bucket centroids and ids of a K1 cluster
+  auto centroids_side_file = [&](uint32_t cid) {
+    return getClusterRawDataFileName(para.indexPrefixPath, cid) + ".centroids";
+  };
+  auto centroids_id_side_file = [&](uint32_t cid) {
+    return getClusterRawDataFileName(para.indexPrefixPath, cid) +
+           ".centroid_ids";
+  };
+
+  // clusters finished by a previous run of this build. a cluster marked done
+  // may still have its blocks in the side file if the run stopped right
+  // before the rename.
+  std::set<uint32_t> done_clusters;
+  if (manifest != nullptr) {
+    done_clusters = manifest->done_clusters();
+  }
+  std::set<uint32_t> lost_clusters;
+  for (auto cid : done_clusters) {
+    std::string data_file = getClusterRawDataFileName(para.indexPrefixPath, cid);
+    std::string blocks_file = data_file + ".blocks";
+    if (access(blocks_file.c_str(), F_OK) == 0) {
+      std::rename(blocks_file.c_str(), data_file.c_str());
+    }
+    if (access(centroids_id_side_file(cid).c_str(), F_OK) != 0) {
+      lost_clusters.insert(cid);
+    }
+  }
+  if (!done_clusters.empty()) {
+    std::cout << "resume hierarchical clusters, " << done_clusters.size()
+              << " clusters already done" << std::endl;
+  }
+  if (!lost_clusters.empty()) {
+    // the previous run stopped after writing the bucket files, while it
+    // removed the side files. the buckets of those clusters are taken back
+    // from the bucket files.
+    std::map<uint32_t, std::unique_ptr<PositionalWriter>> centroids_writers;
+    std::map<uint32_t, std::unique_ptr<PositionalWriter>> ids_writers;
+    for (auto cid : lost_clusters) {
+      centroids_writers[cid] =
+          std::make_unique<PositionalWriter>(centroids_side_file(cid));
+      ids_writers[cid] =
+          std::make_unique<PositionalWriter>(centroids_id_side_file(cid));
+    }
+    uint32_t old_num, header;
+    IOReader old_centroids_reader(bucket_centroids_file);
+    IOReader old_ids_reader(bucket_centroids_id_file);
+    old_centroids_reader.read((char *)&old_num, sizeof(uint32_t));
+    old_centroids_reader.read((char *)&header, sizeof(uint32_t));
+    old_ids_reader.read((char *)&header, sizeof(uint32_t));
+    old_ids_reader.read((char *)&header, sizeof(uint32_t));
+    std::vector<char> centroid(centroid_size);
+    for (uint32_t j = 0; j < old_num; j++) {
+      uint32_t global_id, cid, bid;
+      old_centroids_reader.read(centroid.data(), centroid_size);
+      old_ids_reader.read((char *)&global_id, sizeof(uint32_t));
+      util::parse_global_block_id(global_id, cid, bid);
+      if (lost_clusters.count(cid)) {
+        centroids_writers[cid]->write_at(centroid.data(), centroid_size,
+                                         bid * centroid_size);
+        ids_writers[cid]->write_at((char *)&global_id, sizeof(uint32_t),
+                                   bid * sizeof(uint32_t));
       }
+    }
+  }
 
-      auto func = [&]() {
-        while (true) {
-          // gurantee the access of todo list
-          std::unique_lock<std::mutex> lock(todo_mutex);
-          if (todo.empty()) {
-            // finish
-            // std::cout << "kmeans worker finish" << std::endl;
-            break;
+  {
+    // one pool for the clustering tasks of all K1 clusters: a sub-task is
+    // scheduled as soon as its parent finishes, and under a memory budget
+    // the next K1 cluster is loaded while the tail of the previous one is
+    // still running.
+    WorkStealingPool pool;
+    const size_t num_workers = pool.size();
+
+    // without a memory budget one cluster is in the pool at a time. with a
+    // budget up to MAX_INFLIGHT_K1_CLUSTERS are, as long as their estimated
+    // footprints fit. one cluster is always admitted.
+    const uint64_t budget = para.buildMemoryBudgetGB * ioreader::GIGABYTE;
+    std::mutex inflight_mutex;
+    std::condition_variable inflight_cv;
+    int inflight = 0;
+    uint64_t inflight_bytes = 0;
+
+    // a cluster is committed in order: its files are closed, it is marked
+    // done in the manifest, then its blocks replace the raw data.
+    auto make_output = [&](uint32_t cid) {
+      auto output = std::make_shared<K1ClusterOutput>();
+      std::string data_file =
+          getClusterRawDataFileName(para.indexPrefixPath, cid);
+      std::string blocks_file = data_file + ".blocks";
+      output->cid = cid;
+      output->data_writer = std::make_unique<PositionalWriter>(blocks_file);
+      output->centroids_writer =
+          std::make_unique<PositionalWriter>(centroids_side_file(cid));
+      output->centroids_id_writer =
+          std::make_unique<PositionalWriter>(centroids_id_side_file(cid));
+      output->on_done = [&, cid, data_file, blocks_file]() {
+        if (manifest != nullptr) {
+          manifest->mark_cluster_done(cid);
+        }
+        std::rename(blocks_file.c_str(), data_file.c_str());
+      };
+      return output;
+    };
+
+    using ContextPtr = std::shared_ptr<K1ClusterContext<DATAT>>;
+    std::function<void(ContextPtr, ClusteringTask)> run_task =
+        [&](ContextPtr ctx, ClusteringTask cur) {
+          // big tasks of the first levels run their omp threads on a share
+          // of the workers, reserved so no other task starts on them.
+          // balance level tasks are small and run single-threaded.
+          size_t extra_threads = 0;
+          if (LevelType(cur.level) < LevelType::BALANCE_LEVEL) {
+            extra_threads = pool.reserve(
+                num_workers / std::max<size_t>(1, pool.active()) - 1);
           }
-          auto cur = todo.front();
-          todo.pop_front();
-          lock.unlock();
-
-          // std::cout << "non_recursive_multilevel_kmeans: "
-          //           << " cur.offset:" << cur.offset
-          //           << " cur.num_elems:" << cur.num_elems
-          //           << " cur.level:" << cur.level << std::endl;
+          omp_set_num_threads(1 + extra_threads);
+
           std::vector<ClusteringTask> output_tasks;
           non_recursive_multilevel_kmeans<DATAT>(
-              i,              // the index of k1 round k-means
-              cur.num_elems,  // number vectors in this cluster
-              datai,          // buffer to place all vectors
-              idi,            // buffer to place all ids
+              ctx->output->cid,    // the index of k1 round k-means
+              cur.num_elems,       // number vectors in this cluster
+              ctx->data.get(),     // buffer to place all vectors
+              ctx->ids.get(),      // buffer to place all ids
               cur.offset,     // the offset of to clustering data in this round
               cluster_dim,    // the dimension of vector
               entry_num,      // threshold, determines when to stop recursive
                               // clustering
               para.blockSize, // general 4096, determines how many vectors can
                               // be placed in a block
-              blk_num,     // output variable, number block output in this round
-                           // clustering
-              data_writer, // file writer 1: to output base vectors
-              centroids_writer,     // file writer 2: to output centroid vectors
-              centroids_id_writer,  // file writer 3: to output centroid ids
-              local_start_position, // the start position of all centroids id
+              ctx->output->blk_num, // in/out: number blocks reserved in
+                                    // this cluster
+              *ctx->output->data_writer, // file writer 1: to output base
+                                         // vectors
+              *ctx->output->centroids_writer, // file writer 2: to output
+                                              // centroid vectors
+              *ctx->output->centroids_id_writer, // file writer 3: to output
+                                                 // centroid ids
               cur.level,    // n-th round recursive clustering, start with 0
-              mutex,        // mutext to protect write out centroids
               output_tasks, // output clustering tasks
               para.vector_use_sq, // whether use scalar quantization on base
                                   // vector
@@ -780,63 +1137,433 @@ void hierarchical_clusters(const BBAnnParameters para, const double avg_len) {
               false,              // k-means parameter
               avg_len             // k-means parameter
           );
-          assert(output_tasks.empty());
-        }
-      };
+          pool.release(extra_threads);
+
+          ctx->pending += output_tasks.size();
+          for (auto &output_task : output_tasks) {
+            pool.submit([&run_task, ctx, output_task]() {
+              run_task(ctx, output_task);
+            });
+          }
+          if (--ctx->pending == 0) {
+            ctx->release();
+            std::lock_guard<std::mutex> lock(inflight_mutex);
+            inflight--;
+            inflight_bytes -= ctx->footprint;
+            inflight_cv.notify_all();
+          }
+        };
 
-      size_t number_workers = 32;
-      std::vector<std::thread> workers;
-      for (size_t i = 0; i < number_workers; ++i) {
-        workers.push_back(std::thread(func));
+    std::deque<K1ClusterInput> inputs;
+    for (uint32_t i = 0; i < K1; i++) {
+      if (done_clusters.count(i) || (int)(i % para.shardNum) != para.shardId) {
+        continue;
       }
+      inputs.push_back({i, getClusterRawDataFileName(para.indexPrefixPath, i),
+                        getClusterGlobalIdsFileName(para.indexPrefixPath, i),
+                        nullptr, true});
+    }
 
-      for (size_t i = 0; i < number_workers; ++i) {
-        workers[i].join();
+    while (!inputs.empty()) {
+      K1ClusterInput input = inputs.front();
+      inputs.pop_front();
+      util::get_bin_metadata(input.data_file, cluster_size, cluster_dim);
+      assert(cluster_dim == centroids_dim);
+      // the vectors and ids, plus the cluster ids of the clustering tasks
+      uint64_t footprint =
+          1ULL * cluster_size *
+          (cluster_dim * sizeof(DATAT) + sizeof(uint32_t) + sizeof(int64_t));
+
+      if (budget > 0 && footprint > budget && input.splittable &&
+          cluster_size > 2 * entry_num) {
+        // the split runs on this thread next to the clusters in the pool,
+        // its batches and sample take half of the budget
+        {
+          std::unique_lock<std::mutex> lock(inflight_mutex);
+          inflight_cv.wait(lock, [&]() {
+            return inflight == 0 || inflight_bytes + budget / 2 <= budget;
+          });
+        }
+        TimeRecorder rci("split-cluster-" + std::to_string(input.cid));
+        int64_t nparts = std::min<int64_t>(
+            (2 * footprint + budget - 1) / budget, cluster_size / entry_num);
+        int64_t sample_num = std::min<int64_t>(
+            cluster_size, nparts * K2_MAX_POINTS_PER_CENTROID);
+        std::cout << input.data_file << " with " << cluster_size
+                  << " points needs " << footprint
+                  << " bytes, exceeds the memory budget, split into " << nparts
+                  << " partitions" << std::endl;
+        std::vector<float> part_centroids(nparts * cluster_dim);
+        {
+          std::vector<DATAT> sample_data(sample_num * cluster_dim);
+          random_access_sampling(input.data_file, sample_num,
+                                 sample_data.data());
+          kmeans<DATAT>(sample_num, sample_data.data(), cluster_dim, nparts,
+                        part_centroids.data(), false, avg_len);
+        }
+        rci.RecordSection("train partition centroids done");
+
+        std::vector<std::string> part_data_files(nparts), part_ids_files(nparts);
+        for (int64_t k = 0; k < nparts; k++) {
+          part_data_files[k] = input.data_file + ".part-" + std::to_string(k);
+          part_ids_files[k] = input.ids_file + ".part-" + std::to_string(k);
+        }
+        std::vector<uint32_t> part_size;
+        int64_t batch_size = std::max<int64_t>(
+            1, std::min<uint64_t>(1000000, budget / 8 /
+                                               (cluster_dim * sizeof(DATAT) +
+                                                sizeof(uint32_t))));
+        partition_by_centroids<DATAT, DISTT>(
+            input.data_file, input.ids_file, part_centroids.data(), nparts,
+            part_data_files, part_ids_files, part_size, batch_size);
+        rci.RecordSection("partition done");
+
+        // a consumed partition file is dropped
+        if (input.output) {
+          std::remove(input.data_file.c_str());
+          std::remove(input.ids_file.c_str());
+        } else {
+          input.output = make_output(input.cid);
+        }
+        for (int64_t k = nparts - 1; k >= 0; k--) {
+          if (part_size[k] == 0) {
+            std::remove(part_data_files[k].c_str());
+            std::remove(part_ids_files[k].c_str());
+            continue;
+          }
+          // a partition that took all the points would be split forever
+          inputs.push_front({input.cid, part_data_files[k], part_ids_files[k],
+                             input.output, part_size[k] < cluster_size});
+        }
+        continue;
       }
 
-      // global_centroids_number will update only once after all clustering
-      // global_centroids_number += blk_num;
+      {
+        std::unique_lock<std::mutex> lock(inflight_mutex);
+        inflight_cv.wait(lock, [&]() {
+          return inflight == 0 ||
+                 (budget > 0 && inflight < MAX_INFLIGHT_K1_CLUSTERS &&
+                  inflight_bytes + footprint <= budget);
+        });
+        inflight++;
+        inflight_bytes += footprint;
+      }
+      TimeRecorder rci("load-cluster-" + std::to_string(input.cid));
+
+      auto ctx = std::make_shared<K1ClusterContext<DATAT>>();
+      ctx->footprint = footprint;
+      {
+        IOReader data_reader(input.data_file);
+        IOReader ids_reader(input.ids_file);
+
+        data_reader.read((char *)&cluster_size, sizeof(uint32_t));
+        data_reader.read((char *)&cluster_dim, sizeof(uint32_t));
+        ids_reader.read((char *)&ids_size, sizeof(uint32_t));
+        ids_reader.read((char *)&ids_dim, sizeof(uint32_t));
+        assert(cluster_dim == centroids_dim);
+        assert(cluster_size == ids_size);
+        assert(ids_dim == 1);
+
+        int64_t data_size = static_cast<int64_t>(cluster_size);
+        ctx->data_size = data_size;
+        ctx->data.reset(new DATAT[data_size * cluster_dim * 1ULL]);
+        ctx->ids.reset(new uint32_t[ids_size * ids_dim]);
+        data_reader.read((char *)ctx->data.get(),
+                         data_size * cluster_dim * sizeof(DATAT));
+        ids_reader.read((char *)ctx->ids.get(),
+                        ids_size * ids_dim * sizeof(uint32_t));
+      }
+      if (input.output) {
+        std::remove(input.data_file.c_str());
+        std::remove(input.ids_file.c_str());
+      } else {
+        input.output = make_output(input.cid);
+      }
+      ctx->output = std::move(input.output);
+      rci.RecordSection("load data done");
 
-      delete[] datai;
-      delete[] idi;
+      ctx->pending = 1;
+      ClusteringTask init{0, ctx->data_size, 0};
+      pool.submit([&run_task, ctx, init]() { run_task(ctx, init); });
     }
 
-    int64_t end_position = centroids_id_writer.get_position();
-    assert(end_position != -1);
-    // std::cout << "global_centroids_number: end_position: " << end_position
-    //           << std::endl;
-
-    // centroid id is uint32_t type
-    global_centroids_number +=
-        (end_position - global_start_position) / sizeof(uint32_t);
-    // std::cout
-    //     << "calculate global_centroids_number by centroids id file position:
-    //     "
-    //     << "global_centroids_number " << global_centroids_number <<
-    //     std::endl;
+    pool.wait_idle();
   }
 
-  uint32_t centroids_id_dim = 1;
-  std::ofstream centroids_meta_writer(bucket_centroids_file,
-                                      std::ios::binary | std::ios::in);
-  std::ofstream centroids_ids_meta_writer(bucket_centroids_id_file,
-                                          std::ios::binary | std::ios::in);
-  centroids_meta_writer.seekp(0);
-  centroids_meta_writer.write((char *)&global_centroids_number,
+  // the buckets of the clusters of this shard are concatenated in cluster
+  // order, then the side files are removed
+  std::vector<uint32_t> shard_clusters;
+  uint32_t global_centroids_number = 0;
+  for (uint32_t i = 0; i < K1; i++) {
+    if ((int)(i % para.shardNum) == para.shardId) {
+      shard_clusters.push_back(i);
+      global_centroids_number +=
+          util::fsize(centroids_id_side_file(i)) / sizeof(uint32_t);
+    }
+  }
+  {
+    uint32_t centroids_id_dim = 1;
+    IOWriter centroids_writer(bucket_centroids_file);
+    IOWriter centroids_id_writer(bucket_centroids_id_file);
+    centroids_writer.write((char *)&global_centroids_number, sizeof(uint32_t));
+    centroids_writer.write((char *)&centroids_dim, sizeof(uint32_t));
+    centroids_id_writer.write((char *)&global_centroids_number,
                               sizeof(uint32_t));
-  centroids_meta_writer.write((char *)&centroids_dim, sizeof(uint32_t));
-  centroids_ids_meta_writer.seekp(0);
-  centroids_ids_meta_writer.write((char *)&global_centroids_number,
-                                  sizeof(uint32_t));
-  centroids_ids_meta_writer.write((char *)&centroids_id_dim, sizeof(uint32_t));
-  centroids_meta_writer.close();
-  centroids_ids_meta_writer.close();
+    centroids_id_writer.write((char *)&centroids_id_dim, sizeof(uint32_t));
+    for (auto cid : shard_clusters) {
+      uint64_t n = util::fsize(centroids_id_side_file(cid)) / sizeof(uint32_t);
+      if (n == 0) {
+        continue;
+      }
+      IOReader centroids_reader(centroids_side_file(cid));
+      IOReader ids_reader(centroids_id_side_file(cid));
+      assert(centroids_reader.get_file_size() == n * centroid_size);
+      centroids_writer.write(centroids_reader.view(n * centroid_size),
+                             n * centroid_size);
+      centroids_id_writer.write(ids_reader.view(n * sizeof(uint32_t)),
+                                n * sizeof(uint32_t));
+    }
+  }
+  for (auto cid : shard_clusters) {
+    std::remove(centroids_side_file(cid).c_str());
+    std::remove(centroids_id_side_file(cid).c_str());
+  }
 
   // std::cout << "hierarchical_clusters generate " << global_centroids_number
   //           << " centroids" << std::endl;
   return;
 }
 
+template <typename DATAT>
+void merge_bucket_shards(const BBAnnParameters para) {
+  TimeRecorder rc("merge bucket shards");
+  std::string bucket_centroids_file =
+      para.indexPrefixPath + "bucket-centroids.bin";
+  std::string bucket_centroids_id_file =
+      para.indexPrefixPath + "cluster-combine_ids.bin";
+
+  uint32_t total_num = 0, dim = 0;
+  std::vector<uint32_t> shard_num(para.shardNum);
+  for (int k = 0; k < para.shardNum; k++) {
+    uint32_t shard_dim, ids_num, ids_dim;
+    util::get_bin_metadata(getShardFileName(bucket_centroids_file, k),
+                           shard_num[k], shard_dim);
+    util::get_bin_metadata(getShardFileName(bucket_centroids_id_file, k),
+                           ids_num, ids_dim);
+    assert(shard_num[k] == ids_num);
+    assert(ids_dim == 1);
+    assert(k == 0 || shard_dim == dim);
+    dim = shard_dim;
+    total_num += shard_num[k];
+  }
+  std::cout << "merge " << para.shardNum << " shards into " << total_num
+            << " buckets" << std::endl;
+
+  uint32_t const_one = 1;
+  IOWriter centroids_writer(bucket_centroids_file);
+  IOWriter centroids_id_writer(bucket_centroids_id_file);
+  centroids_writer.write((char *)&total_num, sizeof(uint32_t));
+  centroids_writer.write((char *)&dim, sizeof(uint32_t));
+  centroids_id_writer.write((char *)&total_num, sizeof(uint32_t));
+  centroids_id_writer.write((char *)&const_one, sizeof(uint32_t));
+
+  const uint64_t batch = 1 << 20;
+  for (int k = 0; k < para.shardNum; k++) {
+    uint32_t header[2];
+    IOReader centroids_reader(getShardFileName(bucket_centroids_file, k));
+    IOReader ids_reader(getShardFileName(bucket_centroids_id_file, k));
+    centroids_reader.read((char *)header, sizeof(header));
+    ids_reader.read((char *)header, sizeof(header));
+    for (uint64_t j = 0; j < shard_num[k]; j += batch) {
+      uint64_t n = std::min<uint64_t>(batch, shard_num[k] - j);
+      centroids_writer.write(centroids_reader.view(n * dim * sizeof(DATAT)),
+                             n * dim * sizeof(DATAT));
+      centroids_id_writer.write(ids_reader.view(n * sizeof(uint32_t)),
+                                n * sizeof(uint32_t));
+    }
+  }
+  rc.ElapseFromBegin("merge bucket shards done");
+}
+
+template <typename DATAT>
+bool compact_cluster(
+    const BBAnnParameters para, const uint32_t cid, const uint32_t dim,
+    const DeletionBitmap *deleted, const DATAT *data, const uint32_t *ids,
+    const std::map<uint32_t, std::vector<uint64_t>> &placed,
+    const std::string &out_file, const std::string &ids_out_file,
+    std::vector<std::pair<uint32_t, std::vector<DATAT>>> &bucket_centroids,
+    std::vector<uint32_t> &emptied_buckets) {
+  const std::string data_file =
+      getClusterRawDataFileName(para.indexPrefixPath, cid);
+  const uint64_t block_size = para.blockSize;
+  const uint32_t vec_size = sizeof(DATAT) * dim;
+  const uint32_t code_size =
+      para.vector_use_sq ? sizeof(uint8_t) * dim : vec_size;
+  const uint32_t entry_size = code_size + sizeof(uint32_t);
+  const uint32_t entry_num = (block_size - sizeof(uint32_t)) / entry_size;
+  const uint32_t blk_num = util::fsize(data_file) / block_size;
+  assert(entry_num > 0);
+
+  std::vector<DATAT> max_len(dim);
+  std::vector<DATAT> min_len(dim);
+  if (para.vector_use_sq) {
+    IOReader meta_reader(getSQMetaFileName(para.indexPrefixPath));
+    meta_reader.read((char *)max_len.data(), sizeof(DATAT) * dim);
+    meta_reader.read((char *)min_len.data(), sizeof(DATAT) * dim);
+  }
+
+  // the ids of the entries in the written blocks, in block order
+  std::vector<uint32_t> block_ids;
+  auto collect_ids = [&](const char *blk) {
+    const uint32_t num = *reinterpret_cast<const uint32_t *>(blk);
+    for (uint32_t k = 0; k < num; k++) {
+      block_ids.push_back(*reinterpret_cast<const uint32_t *>(
+          blk + sizeof(uint32_t) + entry_size * k + code_size));
+    }
+  };
+
+  bool changed = false;
+  // buckets split off an overflowing one, appended after the existing blocks
+  std::vector<char> new_blocks;
+  std::vector<char> blk(block_size);
+  std::vector<char> entries;
+  std::vector<DATAT> vecs;
+  std::vector<uint32_t> order;
+  {
+    // one block at a time: read it, rewrite it in place if it changes
+    IOReader reader(data_file);
+    IOWriter writer(out_file);
+    for (uint32_t bid = 0; bid < blk_num; bid++) {
+      reader.read(blk.data(), block_size);
+      const uint32_t old_num = *reinterpret_cast<uint32_t *>(blk.data());
+
+      entries.clear();
+      for (uint32_t k = 0; k < old_num; k++) {
+        const char *entry = blk.data() + sizeof(uint32_t) + entry_size * k;
+        const uint32_t id =
+            *reinterpret_cast<const uint32_t *>(entry + code_size);
+        if (deleted == nullptr || !deleted->test(id)) {
+          entries.insert(entries.end(), entry, entry + entry_size);
+        }
+      }
+      auto it = placed.find(bid);
+      if (it != placed.end()) {
+        const uint64_t base = entries.size();
+        entries.resize(base + it->second.size() * entry_size);
+        for (uint64_t j = 0; j < it->second.size(); j++) {
+          char *entry = entries.data() + base + j * entry_size;
+          const uint64_t row = it->second[j];
+          if (para.vector_use_sq) {
+            encode_uint8(max_len.data(), min_len.data(),
+                         const_cast<DATAT *>(data + row * dim),
+                         reinterpret_cast<uint8_t *>(entry), 1, dim);
+          } else {
+            memcpy(entry, data + row * dim, vec_size);
+          }
+          memcpy(entry + code_size, ids + row, sizeof(uint32_t));
+        }
+      }
+      const uint64_t total = entries.size() / entry_size;
+      if (total == old_num && it == placed.end()) {
+        writer.write(blk.data(), block_size);
+        collect_ids(blk.data());
+        continue;
+      }
+      changed = true;
+      if (total == 0) {
+        // the block stays as an empty bucket, its router node goes
+        memset(blk.data(), 0, block_size);
+        writer.write(blk.data(), block_size);
+        emptied_buckets.push_back(util::gen_global_block_id(cid, bid));
+        continue;
+      }
+
+      vecs.resize(total * dim);
+      for (uint64_t j = 0; j < total; j++) {
+        char *entry = entries.data() + j * entry_size;
+        if (para.vector_use_sq) {
+          decode_uint8(max_len.data(), min_len.data(), vecs.data() + j * dim,
+                       reinterpret_cast<uint8_t *>(entry), 1, dim);
+        } else {
+          memcpy(vecs.data() + j * dim, entry, vec_size);
+        }
+      }
+      order.resize(total);
+      std::iota(order.begin(), order.end(), 0);
+
+      // an overflowing bucket is split into balanced parts, the entries are
+      // grouped by part and cut into equal runs that fit a block
+      const uint64_t parts =
+          std::max<uint64_t>(1, (total + entry_num - 1) / entry_num);
+      if (parts > 1) {
+        std::vector<float> part_centroids(parts * dim);
+        std::vector<int64_t> assign(total);
+        same_size_kmeans<DATAT>(total, vecs.data(), dim, parts,
+                                part_centroids.data(), assign.data());
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t x, uint32_t y) {
+                           return assign[x] < assign[y];
+                         });
+      }
+
+      for (uint64_t p = 0; p < parts; p++) {
+        const uint64_t begin = total * p / parts;
+        const uint64_t end = total * (p + 1) / parts;
+        uint32_t out_bid = bid;
+        char *out = blk.data();
+        if (p > 0) {
+          out_bid = blk_num + new_blocks.size() / block_size;
+          new_blocks.resize(new_blocks.size() + block_size);
+          out = new_blocks.data() + new_blocks.size() - block_size;
+        }
+        assert(out_bid <= 0xffffff);
+        memset(out, 0, block_size);
+        *reinterpret_cast<uint32_t *>(out) = end - begin;
+        std::vector<float> sum(dim, 0);
+        for (uint64_t j = begin; j < end; j++) {
+          memcpy(out + sizeof(uint32_t) + (j - begin) * entry_size,
+                 entries.data() + order[j] * entry_size, entry_size);
+          const DATAT *vec = vecs.data() + order[j] * dim;
+          for (uint32_t d = 0; d < dim; d++) {
+            sum[d] += vec[d];
+          }
+        }
+        std::vector<DATAT> centroid(dim);
+        for (uint32_t d = 0; d < dim; d++) {
+          centroid[d] = (DATAT)(sum[d] / (end - begin));
+        }
+        bucket_centroids.emplace_back(
+            util::gen_global_block_id(cid, out_bid), std::move(centroid));
+      }
+      writer.write(blk.data(), block_size);
+      collect_ids(blk.data());
+    }
+    if (!new_blocks.empty()) {
+      writer.write(new_blocks.data(), new_blocks.size());
+      for (uint64_t off = 0; off < new_blocks.size(); off += block_size) {
+        collect_ids(new_blocks.data() + off);
+      }
+    }
+  }
+  if (!changed) {
+    std::remove(out_file.c_str());
+    return false;
+  }
+
+  // the global ids file lists exactly the ids left in the blocks
+  {
+    IOWriter writer(ids_out_file);
+    uint32_t n = block_ids.size();
+    uint32_t const_one = 1;
+    writer.write((char *)&n, sizeof(uint32_t));
+    writer.write((char *)&const_one, sizeof(uint32_t));
+    writer.write((char *)block_ids.data(), block_ids.size() * sizeof(uint32_t));
+  }
+  std::cout << "compact cluster " << cid << ": " << blk_num << " blocks, "
+            << new_blocks.size() / block_size << " split off" << std::endl;
+  return true;
+}
+
 #define ALGO_LIB_DECL(DATAT)                                                   \
   template void train_cluster<DATAT>(                                          \
       const std::string &raw_data_bin_file, const std::string &output_path,    \
@@ -844,13 +1571,25 @@ void hierarchical_clusters(const BBAnnParameters para, const double avg_len) {
       bool vector_use_sq = false);                                             \
   template void reservoir_sampling<DATAT>(const std::string &data_file,        \
                                           const size_t sample_num,             \
-                                          DATAT *sample_data);
+                                          DATAT *sample_data);                 \
+  template void random_access_sampling<DATAT>(const std::string &data_file,    \
+                                              const size_t sample_num,         \
+                                              DATAT *sample_data);             \
+  template void merge_bucket_shards<DATAT>(const BBAnnParameters para);       \
+  template bool compact_cluster<DATAT>(                                        \
+      const BBAnnParameters para, const uint32_t cid, const uint32_t dim,      \
+      const DeletionBitmap *deleted, const DATAT *data, const uint32_t *ids,   \
+      const std::map<uint32_t, std::vector<uint64_t>> &placed,                 \
+      const std::string &out_file, const std::string &ids_out_file,            \
+      std::vector<std::pair<uint32_t, std::vector<DATAT>>> &bucket_centroids,  \
+      std::vector<uint32_t> &emptied_buckets);
 
 #define ALGO_LIB_DECL_2(DATAT, DISTT)                                          \
   template void divide_raw_data<DATAT, DISTT>(const BBAnnParameters para,      \
                                               const float *centroids);         \
   template void hierarchical_clusters<DATAT, DISTT>(                           \
-      const BBAnnParameters para, const double avg_len);                       \
+      const BBAnnParameters para, const double avg_len,                        \
+      BuildManifest *manifest);                                                \
   template void search_graph<DATAT, DISTT>(                                    \
       std::shared_ptr<hnswlib::HierarchicalNSW<DISTT>> index_hnsw,             \
       const int nq, const int dq, const int nprobe, const int refine_nprobe,   \
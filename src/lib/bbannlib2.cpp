@@ -2,14 +2,20 @@
 #include "ann_interface.h"
 #include "sq_hnswlib/hnswalg.h"
 #include "util/TimeRecorder.h"
+#include "util/build_manifest.h"
 #include "util/file_handler.h"
 #include "util/heap.h"
+#include "util/merge.h"
 #include "util/utils_inline.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <omp.h>
 #include <stdint.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 
 #include <fcntl.h> // open, pread
@@ -48,11 +54,41 @@ public:
   // std::shared_ptr<TimeRecorder> rc;
 };
 
+// a compaction writes every file it replaces next to it with a ".compact"
+// suffix, then lists the replaced files in the journal and renames them. the
+// renames of a compaction that stopped after writing its journal are
+// finished here, before the files are loaded.
+void finish_compaction(const std::string &index_prefix) {
+  std::string journal = getCompactJournalFileName(index_prefix);
+  if (access(journal.c_str(), F_OK) != 0) {
+    return;
+  }
+  std::ifstream reader(journal);
+  std::string file;
+  while (std::getline(reader, file)) {
+    std::string compacted = file + ".compact";
+    if (access(compacted.c_str(), F_OK) == 0) {
+      std::rename(compacted.c_str(), file.c_str());
+    }
+  }
+  reader.close();
+  // the renames are on the disk before the journal is dropped
+  util::sync_parent_dir(journal);
+  std::remove(journal.c_str());
+}
+
 template <typename dataT, typename distanceT>
 bool BBAnnIndex2<dataT, distanceT>::LoadIndex(std::string &indexPathPrefix,
                                               const BBAnnParameters para) {
+  if (para.hnswHugePages < 0 || para.hnswHugePages > 3) {
+    std::cout << "hnswHugePages must be 0 to 3, got " << para.hnswHugePages
+              << std::endl;
+    return false;
+  }
   indexPrefix_ = indexPathPrefix;
+  K1_ = para.K1;
   std::cout << "Loading: " << indexPrefix_;
+  finish_compaction(indexPrefix_);
   uint32_t bucket_num, dim;
   util::get_bin_metadata(getBucketCentroidsFileName(), bucket_num, dim);
 
@@ -75,15 +111,35 @@ bool BBAnnIndex2<dataT, distanceT>::LoadIndex(std::string &indexPathPrefix,
     index_hnsw_ = nullptr;
     index_sq_hnsw_ = std::make_shared<sq_hnswlib::HierarchicalNSW<float>>(
         space, getHnswIndexFileName());
+    if (para.hnswHugePages != 0) {
+      index_sq_hnsw_->useHugePages(
+          (HugePagePolicy)para.hnswHugePages);
+    }
   } else {
     // hnswlib::SpaceInterface<distanceT> *space =
     auto *space = getDistanceSpace<dataT, distanceT>(metric_, dim);
     // load hnsw
-    index_hnsw_ = std::make_shared<hnswlib::HierarchicalNSW<distanceT>>(
-        space, getHnswIndexFileName());
+    if (para.hnswMmapLoad) {
+      index_hnsw_ = std::make_shared<hnswlib::HierarchicalNSW<distanceT>>(space);
+      index_hnsw_->loadIndexMapped(getHnswIndexFileName(), space);
+    } else {
+      index_hnsw_ = std::make_shared<hnswlib::HierarchicalNSW<distanceT>>(
+          space, getHnswIndexFileName());
+    }
+    if (para.hnswCompressLinks) {
+      index_hnsw_->compressLevel0();
+    }
+    if (para.hnswHugePages != 0) {
+      index_hnsw_->useHugePages((HugePagePolicy)para.hnswHugePages);
+    }
     index_sq_hnsw_ = nullptr;
   }
 
+  delta_ = std::make_shared<DeltaIndex<dataT, distanceT>>(metric_, dim);
+  delta_->Open(getDeltaWalFileName(indexPrefix_));
+  deleted_ = std::make_shared<DeletionBitmap>();
+  deleted_->Open(getDeletedIdsFileName(indexPrefix_));
+
   indexPrefix_ = indexPathPrefix;
   return true;
 }
@@ -93,7 +149,8 @@ void search_bbann_queryonly(
     std::shared_ptr<hnswlib::HierarchicalNSW<DISTT>> index_hnsw,
     std::shared_ptr<sq_hnswlib::HierarchicalNSW<float>> index_sq_hnsw,
     const BBAnnParameters para, const int topk, const DATAT *pquery,
-    uint32_t *answer_ids, DISTT *answer_dists, uint32_t nq, uint32_t dim) {
+    uint32_t *answer_ids, DISTT *answer_dists, uint32_t nq, uint32_t dim,
+    const DeletionBitmap *deleted) {
   TimeRecorder rc("search bigann");
 
   if (index_hnsw) {
@@ -272,6 +329,16 @@ void search_bbann_queryonly(
     for (uint32_t k = 0; k < entry_num; ++k) {
       char *entry_begin = buf_begin + entry_size * k;
 
+      uint32_t id;
+      if (para.vector_use_sq) {
+        id = *reinterpret_cast<uint32_t *>(entry_begin + code_size);
+      } else {
+        id = *reinterpret_cast<uint32_t *>(entry_begin + vec_size);
+      }
+      if (deleted != nullptr && deleted->test(id)) {
+        continue;
+      }
+
       if (para.vector_use_sq) {
         decode_uint8(max_len.data(), min_len.data(), code_vec.data(),
                      reinterpret_cast<uint8_t *>(entry_begin), 1, dim);
@@ -282,13 +349,6 @@ void search_bbann_queryonly(
 
       auto dis = dis_computer(vec, q_idx, dim);
 
-      uint32_t id;
-      if (para.vector_use_sq) {
-        id = *reinterpret_cast<uint32_t *>(entry_begin + code_size);
-      } else {
-        id = *reinterpret_cast<uint32_t *>(entry_begin + vec_size);
-      }
-
       if (cmp_func(answer_dists[topk * q], dis)) {
         heap_swap_top_func(topk, answer_dists + topk * q, answer_ids + topk * q,
                            dis, id);
@@ -301,6 +361,10 @@ void search_bbann_queryonly(
     const auto ii = i * nprobe;
 
     for (int64_t j = 0; j < nprobe; ++j) {
+      // a repeated bucket fills the probes the router had no node for
+      if (j > 0 && bucket_labels[ii + j] == bucket_labels[ii + j - 1]) {
+        continue;
+      }
       compare_by_label(i, ii + j, bufs, twice);
     }
   };
@@ -409,17 +473,385 @@ void BBAnnIndex2<dataT, distanceT>::BatchSearchCpp(
   //           << "use_hnsw_sq: " << (para.use_hnsw_sq ? std::string("true") :
   //           std::string("false"))
   //           << std::endl;
+  std::shared_lock<std::shared_mutex> lock(swap_mutex_);
+  // entries of deleted ids are skipped, no bit tests while nothing is deleted
+  const DeletionBitmap *deleted =
+      deleted_ && deleted_->count() > 0 ? deleted_.get() : nullptr;
   if (para.use_hnsw_sq) {
     search_bbann_queryonly<dataT, distanceT>(nullptr, index_sq_hnsw_, para, knn,
                                              pquery, answer_ids, answer_dists,
-                                             numQuery, dim);
+                                             numQuery, dim, deleted);
   } else {
     search_bbann_queryonly<dataT, distanceT>(index_hnsw_, nullptr, para, knn,
                                              pquery, answer_ids, answer_dists,
-                                             numQuery, dim);
+                                             numQuery, dim, deleted);
+  }
+
+  // the disk answers come out as heaps, they are sorted whether or not the
+  // top-k of the inserted vectors is merged into them
+  auto sort_answers = [&](auto cmp) {
+    using C = decltype(cmp);
+#pragma omp parallel for
+    for (int64_t i = 0; i < (int64_t)numQuery; i++) {
+      heap_reorder<C>(knn, answer_dists + i * knn, answer_ids + i * knn);
+    }
+    if (delta_ && delta_->size() > 0) {
+      std::vector<uint32_t> delta_ids(numQuery * knn);
+      std::vector<distanceT> delta_dists(numQuery * knn);
+      delta_->Search(pquery, numQuery, knn, delta_ids.data(),
+                     delta_dists.data(), deleted);
+      merge<C>(answer_dists, answer_ids, delta_dists.data(), delta_ids.data(),
+               numQuery, knn, 0);
+    }
+  };
+  if (para.metric == MetricType::L2) {
+    sort_answers(CMax<distanceT, uint32_t>());
+  } else {
+    sort_answers(CMin<distanceT, uint32_t>());
+  }
+}
+
+template <typename dataT, typename distanceT>
+void BBAnnIndex2<dataT, distanceT>::Insert(const dataT *data,
+                                           const uint32_t *ids, uint64_t n) {
+  assert(delta_ != nullptr);
+  std::shared_lock<std::shared_mutex> lock(swap_mutex_);
+  delta_->Insert(data, ids, n);
+}
+
+template <typename dataT, typename distanceT>
+void BBAnnIndex2<dataT, distanceT>::Delete(const uint32_t *ids, uint64_t n) {
+  assert(deleted_ != nullptr);
+  std::shared_lock<std::shared_mutex> lock(swap_mutex_);
+  std::lock_guard<std::mutex> clusters(cluster_mutex_);
+  MapClusters();
+  deleted_->Delete(ids, n);
+  for (uint64_t i = 0; i < n; i++) {
+    uint32_t cid = cluster_map_->get(ids[i]);
+    if (cid != ClusterMap::NONE) {
+      cluster_deleted_[cid]++;
+    }
   }
 }
 
+template <typename dataT, typename distanceT>
+void BBAnnIndex2<dataT, distanceT>::MapClusters() {
+  if (cluster_map_ != nullptr) {
+    return;
+  }
+  TimeRecorder rc("map clusters");
+  cluster_map_ = std::make_unique<ClusterMap>();
+  cluster_deleted_.assign(K1_, 0);
+  cluster_unmapped_.assign(K1_, false);
+  for (uint32_t cid = 0; cid < K1_; cid++) {
+    std::string ids_file = getClusterGlobalIdsFileName(cid);
+    if (cid >= ClusterMap::MAX_CLUSTERS ||
+        access(ids_file.c_str(), F_OK) != 0) {
+      cluster_unmapped_[cid] = true;
+      continue;
+    }
+    IOReader reader(ids_file);
+    uint32_t n, ids_dim;
+    reader.read((char *)&n, sizeof(uint32_t));
+    reader.read((char *)&ids_dim, sizeof(uint32_t));
+    assert(ids_dim == 1);
+    const uint64_t batch = 1 << 20;
+    for (uint64_t i = 0; i < n; i += batch) {
+      uint64_t m = std::min<uint64_t>(batch, n - i);
+      auto ids = (const uint32_t *)reader.view(m * sizeof(uint32_t));
+      for (uint64_t j = 0; j < m; j++) {
+        cluster_map_->set(ids[j], cid);
+      }
+    }
+  }
+  // the deletions replayed from the log are not compacted yet
+  for (auto id : deleted_->logged()) {
+    uint32_t cid = cluster_map_->get(id);
+    if (cid != ClusterMap::NONE) {
+      cluster_deleted_[cid]++;
+    }
+  }
+  rc.ElapseFromBegin("map clusters done");
+}
+
+template <typename dataT, typename distanceT>
+bool BBAnnIndex2<dataT, distanceT>::Compact(const BBAnnParameters para) {
+  TimeRecorder rc("compact bbann");
+  if (para.use_hnsw_sq || index_hnsw_ == nullptr) {
+    std::cout << "compaction needs the hnsw router, hnsw sq is not supported"
+              << std::endl;
+    return false;
+  }
+  if (para.hnswHugePages < 0 || para.hnswHugePages > 3) {
+    std::cout << "hnswHugePages must be 0 to 3, got " << para.hnswHugePages
+              << std::endl;
+    return false;
+  }
+  if ((uint32_t)para.K1 != K1_) {
+    std::cout << "compaction needs the K1 of the loaded index " << K1_
+              << ", got " << para.K1 << std::endl;
+    return false;
+  }
+  std::unique_lock<std::mutex> running(compact_mutex_, std::try_to_lock);
+  if (!running.owns_lock()) {
+    std::cout << "skip compaction, another one is running" << std::endl;
+    return false;
+  }
+
+  // the inserts and deletes up to here are compacted, later ones stay in the
+  // delta and the bitmap
+  std::vector<dataT> delta_data;
+  std::vector<uint32_t> delta_ids;
+  const uint64_t delta_num = delta_->Snapshot(delta_data, delta_ids);
+  uint64_t deleted_num;
+  std::vector<uint64_t> cluster_deleted;
+  std::vector<bool> cluster_unmapped;
+  {
+    std::lock_guard<std::mutex> clusters(cluster_mutex_);
+    deleted_num = deleted_->log_size();
+    if (deleted_num > 0) {
+      MapClusters();
+    }
+    if (cluster_map_ != nullptr) {
+      cluster_deleted.swap(cluster_deleted_);
+      cluster_deleted_.assign(K1_, 0);
+      cluster_unmapped = cluster_unmapped_;
+    }
+  }
+  if (delta_num == 0 && deleted_num == 0) {
+    std::cout << "nothing to compact" << std::endl;
+    return true;
+  }
+  std::cout << "compact " << delta_num << " inserted vectors and "
+            << deleted_num << " deletions" << std::endl;
+  const DeletionBitmap *deleted =
+      deleted_->count() > 0 ? deleted_.get() : nullptr;
+
+  uint32_t bucket_num, dim;
+  util::get_bin_metadata(getBucketCentroidsFileName(), bucket_num, dim);
+
+  // every inserted vector goes to the bucket of its nearest router node
+  std::vector<uint32_t> labels(delta_num);
+  if (delta_num > 0) {
+    search_graph<dataT, distanceT>(index_hnsw_, delta_num, dim, 1,
+                                   para.efSearch, delta_data.data(),
+                                   labels.data(), nullptr);
+  }
+  std::vector<std::map<uint32_t, std::vector<uint64_t>>> placed(para.K1);
+  for (uint64_t i = 0; i < delta_num; i++) {
+    if (deleted != nullptr && deleted->test(delta_ids[i])) {
+      continue;
+    }
+    uint32_t cid, bid;
+    util::parse_global_block_id(labels[i], cid, bid);
+    placed[cid][bid].push_back(i);
+  }
+  rc.RecordSection("place " + std::to_string(delta_num) +
+                   " inserted vectors done");
+
+  // only the clusters that get inserted vectors or hold deleted ones are
+  // rewritten, together with their global ids file
+  std::vector<std::string> compacted_files;
+  std::vector<std::pair<uint32_t, std::vector<dataT>>> bucket_centroids;
+  std::vector<uint32_t> emptied_buckets;
+  std::vector<uint32_t> remapped;
+  uint32_t rewritten = 0;
+  for (uint32_t cid = 0; cid < para.K1; cid++) {
+    const bool holds_deleted =
+        deleted_num > 0 && (cluster_deleted[cid] > 0 || cluster_unmapped[cid]);
+    if (placed[cid].empty() && !holds_deleted) {
+      continue;
+    }
+    std::string data_file = getClusterRawDataFileName(cid);
+    std::string ids_file = getClusterGlobalIdsFileName(cid);
+    if (compact_cluster<dataT>(para, cid, dim, deleted, delta_data.data(),
+                               delta_ids.data(), placed[cid],
+                               data_file + ".compact", ids_file + ".compact",
+                               bucket_centroids, emptied_buckets)) {
+      compacted_files.push_back(data_file);
+      compacted_files.push_back(ids_file);
+      rewritten++;
+      if (!cluster_unmapped.empty() && cluster_unmapped[cid] &&
+          cid < ClusterMap::MAX_CLUSTERS) {
+        remapped.push_back(cid);
+      }
+    }
+  }
+  rc.RecordSection("rewrite " + std::to_string(rewritten) + " clusters done");
+
+  // the placed ids now live in the blocks of their cluster, as do the ids of
+  // a cluster that had no global ids file. an id deleted after its block was
+  // written is still in it and counted here, a later deletion by Delete.
+  if (cluster_map_ != nullptr) {
+    std::lock_guard<std::mutex> clusters(cluster_mutex_);
+    for (uint32_t cid = 0; cid < para.K1; cid++) {
+      if (cluster_unmapped_[cid]) {
+        continue;
+      }
+      for (const auto &[bid, rows] : placed[cid]) {
+        for (auto row : rows) {
+          cluster_map_->set(delta_ids[row], cid);
+          cluster_deleted_[cid] += deleted_->test(delta_ids[row]);
+        }
+      }
+    }
+    for (auto cid : remapped) {
+      IOReader reader(getClusterGlobalIdsFileName(cid) + ".compact");
+      uint32_t n, ids_dim;
+      reader.read((char *)&n, sizeof(uint32_t));
+      reader.read((char *)&ids_dim, sizeof(uint32_t));
+      auto ids = (const uint32_t *)reader.view((uint64_t)n * sizeof(uint32_t));
+      for (uint32_t j = 0; j < n; j++) {
+        cluster_map_->set(ids[j], cid);
+        cluster_deleted_[cid] += deleted_->test(ids[j]);
+      }
+      cluster_unmapped_[cid] = false;
+    }
+  }
+
+  // the router is updated on a copy that replaces the loaded one. changed
+  // buckets move their centroid node, split off buckets get a new one and the
+  // node of an emptied bucket is marked deleted, so the searches do not spend
+  // probes on it.
+  std::shared_ptr<hnswlib::HierarchicalNSW<distanceT>> router;
+  if (!bucket_centroids.empty() || !emptied_buckets.empty()) {
+    auto *space = getDistanceSpace<dataT, distanceT>(metric_, dim);
+    router = std::make_shared<hnswlib::HierarchicalNSW<distanceT>>(
+        space, getHnswIndexFileName());
+    uint64_t added = 0;
+    for (const auto &[gid, centroid] : bucket_centroids) {
+      uint32_t cid, bid;
+      util::parse_global_block_id(gid, cid, bid);
+      added += router->label_lookup_.count(util::gen_id(cid, bid, 0)) == 0;
+    }
+    router->resizeIndex(router->cur_element_count + added);
+    for (const auto &[gid, centroid] : bucket_centroids) {
+      uint32_t cid, bid;
+      util::parse_global_block_id(gid, cid, bid);
+      router->addPoint(centroid.data(), util::gen_id(cid, bid, 0));
+    }
+    for (auto gid : emptied_buckets) {
+      uint32_t cid, bid;
+      util::parse_global_block_id(gid, cid, bid);
+      auto it = router->label_lookup_.find(util::gen_id(cid, bid, 0));
+      if (it != router->label_lookup_.end() &&
+          !router->isMarkedDeleted(it->second)) {
+        router->markDelete(util::gen_id(cid, bid, 0));
+      }
+    }
+    router->saveIndex(getHnswIndexFileName() + ".compact");
+    compacted_files.push_back(getHnswIndexFileName());
+    if (para.hnswMmapLoad) {
+      // serve the saved copy, the mapping follows it when it is renamed
+      router = std::make_shared<hnswlib::HierarchicalNSW<distanceT>>(space);
+      router->loadIndexMapped(getHnswIndexFileName() + ".compact", space);
+    }
+    if (para.hnswCompressLinks) {
+      router->compressLevel0();
+    }
+    if (para.hnswHugePages != 0) {
+      router->useHugePages((HugePagePolicy)para.hnswHugePages);
+    }
+
+    // keep the bucket files in line with the router
+    dataT *centroids = nullptr;
+    uint32_t *centroids_ids = nullptr;
+    uint32_t nids, ids_dim;
+    util::read_bin_file<dataT>(getBucketCentroidsFileName(), centroids,
+                               bucket_num, dim);
+    util::read_bin_file<uint32_t>(getBucketCentroidsIdsFileName(),
+                                  centroids_ids, nids, ids_dim);
+    assert(nids == bucket_num);
+    std::unordered_map<uint32_t, uint32_t> row;
+    for (uint32_t i = 0; i < nids; i++) {
+      row[centroids_ids[i]] = i;
+    }
+    // the emptied buckets are dropped from the files
+    std::vector<bool> dropped(bucket_num, false);
+    uint32_t dropped_num = 0;
+    for (auto gid : emptied_buckets) {
+      auto it = row.find(gid);
+      if (it != row.end() && !dropped[it->second]) {
+        dropped[it->second] = true;
+        dropped_num++;
+      }
+    }
+    uint32_t total_num = bucket_num + added - dropped_num;
+    IOWriter centroids_writer(getBucketCentroidsFileName() + ".compact");
+    IOWriter centroids_id_writer(getBucketCentroidsIdsFileName() + ".compact");
+    centroids_writer.write((char *)&total_num, sizeof(uint32_t));
+    centroids_writer.write((char *)&dim, sizeof(uint32_t));
+    centroids_id_writer.write((char *)&total_num, sizeof(uint32_t));
+    centroids_id_writer.write((char *)&ids_dim, sizeof(uint32_t));
+    for (const auto &[gid, centroid] : bucket_centroids) {
+      auto it = row.find(gid);
+      if (it != row.end()) {
+        memcpy(centroids + (uint64_t)it->second * dim, centroid.data(),
+               sizeof(dataT) * dim);
+      }
+    }
+    for (uint32_t i = 0; i < bucket_num; i++) {
+      if (!dropped[i]) {
+        centroids_writer.write((char *)(centroids + (uint64_t)i * dim),
+                               sizeof(dataT) * dim);
+        centroids_id_writer.write((char *)(centroids_ids + i),
+                                  sizeof(uint32_t));
+      }
+    }
+    for (const auto &[gid, centroid] : bucket_centroids) {
+      if (row.count(gid) == 0) {
+        centroids_writer.write((char *)centroid.data(), sizeof(dataT) * dim);
+        centroids_id_writer.write((char *)&gid, sizeof(uint32_t));
+      }
+    }
+    compacted_files.push_back(getBucketCentroidsFileName());
+    compacted_files.push_back(getBucketCentroidsIdsFileName());
+    delete[] centroids;
+    delete[] centroids_ids;
+    rc.RecordSection("update " + std::to_string(bucket_centroids.size()) +
+                     " router nodes, " + std::to_string(added) + " new, " +
+                     std::to_string(dropped_num) + " emptied");
+  }
+
+  {
+    std::unique_lock<std::shared_mutex> lock(swap_mutex_);
+    std::string wal_file = getDeltaWalFileName(indexPrefix_);
+    std::string deleted_file = getDeletedIdsFileName(indexPrefix_);
+    delta_->WriteWal(delta_num, wal_file + ".compact");
+    deleted_->WriteLog(deleted_num, deleted_file + ".compact");
+    compacted_files.push_back(wal_file);
+    compacted_files.push_back(deleted_file);
+
+    // the replacements are on the disk before the journal names them, all
+    // the files share the directory of the index prefix
+    std::string journal = getCompactJournalFileName(indexPrefix_);
+    for (const auto &file : compacted_files) {
+      util::sync_file(file + ".compact");
+    }
+    util::sync_parent_dir(journal);
+    {
+      std::ofstream writer(journal + ".tmp");
+      for (const auto &file : compacted_files) {
+        writer << file << std::endl;
+      }
+      writer.close();
+      assert(!writer.fail());
+    }
+    util::sync_file(journal + ".tmp");
+    std::rename((journal + ".tmp").c_str(), journal.c_str());
+    util::sync_parent_dir(journal);
+    finish_compaction(indexPrefix_);
+
+    delta_->Truncate(delta_num);
+    deleted_->Truncate(deleted_num);
+    if (router != nullptr) {
+      index_hnsw_ = router;
+    }
+  }
+  rc.ElapseFromBegin("compact bbann totally done");
+  return true;
+}
+
 template <typename dataT, typename distanceT>
 void BBAnnIndex2<dataT, distanceT>::BuildIndexImpl(const BBAnnParameters para) {
   auto index = std::make_unique<BBAnnIndex2<dataT, distanceT>>(para.metric);
@@ -439,29 +871,115 @@ void BBAnnIndex2<dataT, distanceT>::BuildWithParameter(
             << " hnsw.efConstruction: " << para.hnswefC << " K1: " << para.K1
             << std::endl;
 
+  // stages finished by a previous run with the same parameters are skipped.
+  // every shard of a sharded build keeps its own manifest.
+  const bool sharded = para.shardNum > 1;
+  auto manifest_file = [&](int shard_id) {
+    return sharded ? getShardFileName(getBuildManifestFileName(indexPrefix_),
+                                      shard_id)
+                   : getBuildManifestFileName(indexPrefix_);
+  };
+  BuildManifest manifest(manifest_file(para.shardId), para);
+
+  // block until the given shard has finished the stage
+  auto wait_for_shard = [&](int shard_id, const std::string &stage) {
+    BuildManifest other(manifest_file(shard_id), para, false);
+    if (!other.stage_done(stage)) {
+      std::cout << "wait for shard " << shard_id << " to finish " << stage
+                << std::endl;
+    }
+    while (!other.stage_done(stage)) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      other.reload();
+    }
+  };
+
+  if (sharded && para.shardId != 0) {
+    // shard 0 trains and divides the data, this shard only clusters its part
+    // of the K1 clusters
+    double avg_len;
+    if (!manifest.stage_done("hierarchical_clusters")) {
+      wait_for_shard(0, "divide_raw_data");
+      BuildManifest prepare(manifest_file(0), para, false);
+      prepare.get_value("avg_len", avg_len);
+      hierarchical_clusters<dataT, distanceT>(para, avg_len, &manifest);
+      manifest.mark_stage_done("hierarchical_clusters");
+    }
+    rc.ElapseFromBegin("build shard " + std::to_string(para.shardId) +
+                       " totally done.");
+    return;
+  }
+
   float *centroids = nullptr;
   double avg_len;
-  // sampling and do K1-means to get the first round centroids
-  train_cluster<dataT>(dataFilePath_, indexPrefix_, para.K1, &centroids,
-                       avg_len, para.vector_use_sq);
-  assert(centroids != nullptr);
+  if (manifest.stage_done("train_cluster") &&
+      manifest.get_value("avg_len", avg_len)) {
+    std::cout << "skip train cluster, done by a previous run" << std::endl;
+  } else {
+    // sampling and do K1-means to get the first round centroids
+    train_cluster<dataT>(dataFilePath_, indexPrefix_, para.K1, &centroids,
+                         avg_len, para.vector_use_sq);
+    assert(centroids != nullptr);
+    uint32_t nb, dim;
+    util::get_bin_metadata(dataFilePath_, nb, dim);
+    {
+      IOWriter centroids_writer(getK1CentroidsFileName(indexPrefix_));
+      uint32_t k1 = para.K1;
+      centroids_writer.write((char *)&k1, sizeof(uint32_t));
+      centroids_writer.write((char *)&dim, sizeof(uint32_t));
+      centroids_writer.write((char *)centroids, sizeof(float) * k1 * dim);
+    }
+    manifest.set_value("avg_len", avg_len);
+    manifest.mark_stage_done("train_cluster");
+  }
   rc.RecordSection("train cluster to get " + std::to_string(para.K1) +
                    " centroids done.");
 
-  divide_raw_data<dataT, distanceT>(para, centroids);
+  if (manifest.stage_done("divide_raw_data")) {
+    std::cout << "skip divide raw data, done by a previous run" << std::endl;
+  } else {
+    if (centroids == nullptr) {
+      uint32_t k1, dim;
+      util::read_bin_file<float>(getK1CentroidsFileName(indexPrefix_),
+                                 centroids, k1, dim);
+      assert(k1 == para.K1);
+    }
+    divide_raw_data<dataT, distanceT>(para, centroids);
+    manifest.mark_stage_done("divide_raw_data");
+  }
   rc.RecordSection("divide raw data into " + std::to_string(para.K1) +
                    " clusters done");
 
-  hierarchical_clusters<dataT, distanceT>(para, avg_len);
+  if (manifest.stage_done("hierarchical_clusters")) {
+    std::cout << "skip hierarchical clusters, done by a previous run"
+              << std::endl;
+  } else {
+    hierarchical_clusters<dataT, distanceT>(para, avg_len, &manifest);
+    manifest.mark_stage_done("hierarchical_clusters");
+  }
   rc.RecordSection("conquer each cluster into buckets done");
 
-  if (para.use_hnsw_sq) {
+  if (sharded && !manifest.stage_done("merge_shards")) {
+    for (int k = 1; k < para.shardNum; k++) {
+      wait_for_shard(k, "hierarchical_clusters");
+    }
+    merge_bucket_shards<dataT>(para);
+    manifest.mark_stage_done("merge_shards");
+    rc.RecordSection("merge " + std::to_string(para.shardNum) +
+                     " shards done");
+  }
+
+  if (manifest.stage_done("build_graph")) {
+    std::cout << "skip build graph, done by a previous run" << std::endl;
+  } else if (para.use_hnsw_sq) {
     std::cout << "build graph type: HNSWSQ" << std::endl;
     build_hnsw_sq(indexPrefix_, para.hnswM, para.hnswefC, para.metric);
+    manifest.mark_stage_done("build_graph");
   } else {
     std::cout << "build graph type: HNSW" << std::endl;
     build_graph<dataT, distanceT>(indexPrefix_, para.hnswM, para.hnswefC,
                                   para.metric, para.blockSize, para.sample);
+    manifest.mark_stage_done("build_graph");
   }
   rc.RecordSection("build hnsw done.");
 
@@ -479,6 +997,7 @@ BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(const dataT *pquery, uint64_t dim,
                                               uint64_t numQuery, double radius,
                                               const BBAnnParameters para) {
   TimeRecorder rc("range search bbann");
+  std::shared_lock<std::shared_mutex> lock(swap_mutex_);
 
   std::cout << "query numbers: " << numQuery << " query dims: " << dim
             << std::endl;
@@ -523,6 +1042,8 @@ BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(const dataT *pquery, uint64_t dim,
 
   const uint32_t vec_size = sizeof(dataT) * dim;
   const uint32_t entry_size = vec_size + sizeof(uint32_t);
+  const DeletionBitmap *deleted =
+      deleted_ && deleted_->count() > 0 ? deleted_.get() : nullptr;
   AIOBucketReader reader(para.indexPrefixPath, para.aio_EventsPerBatch);
   // -- a function that reads the file for bucketid/queryid in
   // bucketToQuery[a..b]
@@ -557,11 +1078,14 @@ BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(const dataT *pquery, uint64_t dim,
 
       for (uint32_t k = 0; k < entry_num; ++k) {
         char *entry_begin = data_begin + entry_size * k;
+        const uint32_t id =
+            *reinterpret_cast<uint32_t *>(entry_begin + vec_size);
+        if (deleted != nullptr && deleted->test(id)) {
+          continue;
+        }
         auto dis =
             dis_computer(reinterpret_cast<dataT *>(entry_begin), q_idx, dim);
         if (dis < radius) {
-          const uint32_t id =
-              *reinterpret_cast<uint32_t *>(entry_begin + vec_size);
           ret.push_back(std::make_tuple(qid, id, dis));
         }
       }
@@ -591,6 +1115,10 @@ BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(const dataT *pquery, uint64_t dim,
     //                    "out of " + std::to_string(nparts_block) + " done");
   }
   rc.RecordSection("scan blocks done");
+  if (delta_ && delta_->size() > 0) {
+    delta_->RangeSearch(pquery, numQuery, radius, ans_list, deleted);
+    rc.RecordSection("scan delta done");
+  }
   sort(ans_list.begin(), ans_list.end());
   std::vector<uint32_t> ids;
   std::vector<distanceT> dists;
@@ -633,6 +1161,12 @@ BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(const dataT *pquery, uint64_t dim,
       distanceT *answer_dists);                                                \
   template void BBAnnIndex2<dataT, distanceT>::BuildIndexImpl(                 \
       const BBAnnParameters para);                                             \
+  template void BBAnnIndex2<dataT, distanceT>::Insert(                         \
+      const dataT *data, const uint32_t *ids, uint64_t n);                     \
+  template void BBAnnIndex2<dataT, distanceT>::Delete(const uint32_t *ids,     \
+                                                      uint64_t n);             \
+  template bool BBAnnIndex2<dataT, distanceT>::Compact(                        \
+      const BBAnnParameters para);                                             \
   template std::tuple<std::vector<uint32_t>, std::vector<distanceT>,           \
                       std::vector<uint64_t>>                                   \
   BBAnnIndex2<dataT, distanceT>::RangeSearchCpp(                               \
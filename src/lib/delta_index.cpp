@@ -0,0 +1,221 @@
+#include "lib/delta_index.h"
+#include "util/heap.h"
+#include "util/utils_inline.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+
+namespace bbann {
+
+namespace {
+
+// every Insert is one record: n, dim, n ids, n vectors
+struct WalRecordHeader {
+  uint32_t n;
+  uint32_t dim;
+};
+
+template <class C, typename dataT>
+void delta_search(const dataT *data, const uint32_t *ids, uint64_t n,
+                  uint32_t dim, MetricType metric, const dataT *pquery,
+                  uint64_t nq, uint64_t knn, typename C::TI *answer_ids,
+                  typename C::T *answer_dists, const DeletionBitmap *deleted) {
+  using distanceT = typename C::T;
+  auto dis_computer = util::select_computer<dataT, dataT, distanceT>(metric);
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int64_t q = 0; q < (int64_t)nq; q++) {
+    distanceT *dis = answer_dists + q * knn;
+    uint32_t *lab = answer_ids + q * knn;
+    const dataT *q_idx = pquery + q * dim;
+    heap_heapify<C>(knn, dis, lab);
+    for (uint64_t j = 0; j < n; j++) {
+      if (deleted != nullptr && deleted->test(ids[j])) {
+        continue;
+      }
+      auto d = dis_computer(data + j * dim, q_idx, dim);
+      if (C::cmp(dis[0], d)) {
+        heap_swap_top<C>(knn, dis, lab, d, ids[j]);
+      }
+    }
+    heap_reorder<C>(knn, dis, lab);
+  }
+}
+
+} // namespace
+
+template <typename dataT, typename distanceT>
+DeltaIndex<dataT, distanceT>::~DeltaIndex() {
+  if (wal_fd_ >= 0) {
+    close(wal_fd_);
+  }
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::Open(const std::string &wal_file) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  wal_file_ = wal_file;
+  if (access(wal_file.c_str(), F_OK) != 0) {
+    return;
+  }
+  std::ifstream reader(wal_file, std::ios::binary);
+  uint64_t file_size = util::fsize(wal_file);
+  uint64_t valid_end = 0;
+  WalRecordHeader header;
+  while (valid_end + sizeof(header) <= file_size) {
+    reader.read((char *)&header, sizeof(header));
+    uint64_t body = (uint64_t)header.n * sizeof(uint32_t) +
+                    (uint64_t)header.n * header.dim * sizeof(dataT);
+    if (header.dim != dim_ || valid_end + sizeof(header) + body > file_size) {
+      break;
+    }
+    uint64_t old = ids_.size();
+    ids_.resize(old + header.n);
+    data_.resize((old + header.n) * dim_);
+    reader.read((char *)(ids_.data() + old), header.n * sizeof(uint32_t));
+    reader.read((char *)(data_.data() + old * dim_),
+                (uint64_t)header.n * dim_ * sizeof(dataT));
+    valid_end += sizeof(header) + body;
+  }
+  if (valid_end != file_size) {
+    std::cout << "delta write-ahead file " << wal_file << " has a torn tail of "
+              << file_size - valid_end << " bytes, truncate it" << std::endl;
+    auto r = truncate(wal_file.c_str(), valid_end);
+    assert(r == 0);
+  }
+  std::cout << "replay " << ids_.size() << " delta vectors from " << wal_file
+            << std::endl;
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::Insert(const dataT *data,
+                                          const uint32_t *ids, uint64_t n) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (!wal_file_.empty()) {
+    if (wal_fd_ < 0) {
+      wal_fd_ = open(wal_file_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (wal_fd_ < 0) {
+        std::cout << "open() failed, file: " << wal_file_
+                  << ", errno: " << errno << ", error: " << strerror(errno)
+                  << std::endl;
+        exit(-1);
+      }
+    }
+    // one write per record, a crash leaves at most a torn tail
+    WalRecordHeader header{(uint32_t)n, dim_};
+    std::vector<char> record(sizeof(header) + n * sizeof(uint32_t) +
+                             n * dim_ * sizeof(dataT));
+    memcpy(record.data(), &header, sizeof(header));
+    memcpy(record.data() + sizeof(header), ids, n * sizeof(uint32_t));
+    memcpy(record.data() + sizeof(header) + n * sizeof(uint32_t), data,
+           n * dim_ * sizeof(dataT));
+    auto r = write(wal_fd_, record.data(), record.size());
+    if (r != (ssize_t)record.size() || fdatasync(wal_fd_) != 0) {
+      std::cout << "write() failed, file: " << wal_file_
+                << ", errno: " << errno << ", error: " << strerror(errno)
+                << std::endl;
+      exit(-1);
+    }
+  }
+  ids_.insert(ids_.end(), ids, ids + n);
+  data_.insert(data_.end(), data, data + n * dim_);
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::Search(const dataT *pquery, uint64_t nq,
+                                          uint64_t knn, uint32_t *answer_ids,
+                                          distanceT *answer_dists,
+                                          const DeletionBitmap *deleted) {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  if (metric_ == MetricType::L2) {
+    delta_search<CMax<distanceT, uint32_t>>(data_.data(), ids_.data(),
+                                            ids_.size(), dim_, metric_, pquery,
+                                            nq, knn, answer_ids, answer_dists,
+                                            deleted);
+  } else {
+    delta_search<CMin<distanceT, uint32_t>>(data_.data(), ids_.data(),
+                                            ids_.size(), dim_, metric_, pquery,
+                                            nq, knn, answer_ids, answer_dists,
+                                            deleted);
+  }
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::RangeSearch(
+    const dataT *pquery, uint64_t nq, double radius,
+    std::vector<std::tuple<uint32_t, uint32_t, distanceT>> &ans,
+    const DeletionBitmap *deleted) {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto dis_computer = util::select_computer<dataT, dataT, distanceT>(metric_);
+  const uint64_t n = ids_.size();
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int64_t q = 0; q < (int64_t)nq; q++) {
+    std::vector<std::tuple<uint32_t, uint32_t, distanceT>> part;
+    const dataT *q_idx = pquery + q * dim_;
+    for (uint64_t j = 0; j < n; j++) {
+      if (deleted != nullptr && deleted->test(ids_[j])) {
+        continue;
+      }
+      auto dis = dis_computer(data_.data() + j * dim_, q_idx, dim_);
+      if (dis < radius) {
+        part.emplace_back(q, ids_[j], dis);
+      }
+    }
+    if (!part.empty()) {
+#pragma omp critical
+      ans.insert(ans.end(), part.begin(), part.end());
+    }
+  }
+}
+
+template <typename dataT, typename distanceT>
+uint64_t DeltaIndex<dataT, distanceT>::Snapshot(std::vector<dataT> &data,
+                                                std::vector<uint32_t> &ids) {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  data = data_;
+  ids = ids_;
+  return ids.size();
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::WriteWal(uint64_t from,
+                                            const std::string &file) {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  assert(from <= ids_.size());
+  std::ofstream writer(file, std::ios::binary | std::ios::trunc);
+  uint64_t n = ids_.size() - from;
+  if (n > 0) {
+    WalRecordHeader header{(uint32_t)n, dim_};
+    writer.write((char *)&header, sizeof(header));
+    writer.write((char *)(ids_.data() + from), n * sizeof(uint32_t));
+    writer.write((char *)(data_.data() + from * dim_),
+                 n * dim_ * sizeof(dataT));
+  }
+  writer.close();
+  assert(!writer.fail());
+}
+
+template <typename dataT, typename distanceT>
+void DeltaIndex<dataT, distanceT>::Truncate(uint64_t n) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  assert(n <= ids_.size());
+  ids_.erase(ids_.begin(), ids_.begin() + n);
+  data_.erase(data_.begin(), data_.begin() + n * dim_);
+  if (wal_fd_ >= 0) {
+    close(wal_fd_);
+    wal_fd_ = -1;
+  }
+}
+
+#define DELTA_INDEX_DECL(dataT, distanceT)                                     \
+  template class DeltaIndex<dataT, distanceT>;
+
+DELTA_INDEX_DECL(float, float);
+DELTA_INDEX_DECL(uint8_t, uint32_t);
+DELTA_INDEX_DECL(int8_t, int32_t);
+
+#undef DELTA_INDEX_DECL
+
+} // namespace bbann
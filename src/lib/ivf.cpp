@@ -5,8 +5,11 @@
 #include <assert.h>
 #include <cstdint>
 #include <deque>
+#include <limits>
 #include <memory>
+#include <queue>
 #include <string.h>
+#include <type_traits>
 #include <unistd.h>
 
 #include "util/constants.h"
@@ -16,6 +19,172 @@
 
 namespace {
 
+// points and centroids handled by one call of the inner product kernel
+constexpr int64_t IP_KERNEL_ROWS = 4;
+constexpr int64_t IP_KERNEL_LANES = 16;
+
+// inner products of IP_KERNEL_ROWS consecutive points against a panel of
+// IP_KERNEL_LANES centroids stored interleaved by dimension. out is
+// IP_KERNEL_ROWS x IP_KERNEL_LANES.
+inline void ip_kernel(const float *x, const float *panel, int64_t dim,
+                      float *out) {
+#if defined(__AVX2__) && defined(__FMA__)
+  static_assert(IP_KERNEL_ROWS == 4 && IP_KERNEL_LANES == 16, "");
+  __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+  const float *x0 = x, *x1 = x + dim, *x2 = x + 2 * dim, *x3 = x + 3 * dim;
+  for (int64_t d = 0; d < dim; d++) {
+    __m256 y0 = _mm256_loadu_ps(panel + d * IP_KERNEL_LANES);
+    __m256 y1 = _mm256_loadu_ps(panel + d * IP_KERNEL_LANES + 8);
+    __m256 b = _mm256_broadcast_ss(x0 + d);
+    c00 = _mm256_fmadd_ps(b, y0, c00);
+    c01 = _mm256_fmadd_ps(b, y1, c01);
+    b = _mm256_broadcast_ss(x1 + d);
+    c10 = _mm256_fmadd_ps(b, y0, c10);
+    c11 = _mm256_fmadd_ps(b, y1, c11);
+    b = _mm256_broadcast_ss(x2 + d);
+    c20 = _mm256_fmadd_ps(b, y0, c20);
+    c21 = _mm256_fmadd_ps(b, y1, c21);
+    b = _mm256_broadcast_ss(x3 + d);
+    c30 = _mm256_fmadd_ps(b, y0, c30);
+    c31 = _mm256_fmadd_ps(b, y1, c31);
+  }
+  _mm256_storeu_ps(out, c00);
+  _mm256_storeu_ps(out + 8, c01);
+  _mm256_storeu_ps(out + 16, c10);
+  _mm256_storeu_ps(out + 24, c11);
+  _mm256_storeu_ps(out + 32, c20);
+  _mm256_storeu_ps(out + 40, c21);
+  _mm256_storeu_ps(out + 48, c30);
+  _mm256_storeu_ps(out + 56, c31);
+#else
+  for (int64_t r = 0; r < IP_KERNEL_ROWS; r++) {
+    float *o = out + r * IP_KERNEL_LANES;
+    for (int64_t l = 0; l < IP_KERNEL_LANES; l++) {
+      o[l] = 0;
+    }
+    for (int64_t d = 0; d < dim; d++) {
+      const float xd = x[r * dim + d];
+      const float *p = panel + d * IP_KERNEL_LANES;
+      for (int64_t l = 0; l < IP_KERNEL_LANES; l++) {
+        o[l] += xd * p[l];
+      }
+    }
+  }
+#endif
+}
+
+// centroids packed into panels of IP_KERNEL_LANES interleaved by dimension,
+// with their squared norms. padding lanes get an infinite norm so they never
+// win.
+struct PackedCentroids {
+  PackedCentroids(const float *y, int64_t dim, int64_t ny)
+      : dim(dim), ny(ny),
+        npanel((ny + IP_KERNEL_LANES - 1) / IP_KERNEL_LANES),
+        panels(npanel * dim * IP_KERNEL_LANES, 0),
+        norms(npanel * IP_KERNEL_LANES,
+              std::numeric_limits<float>::infinity()) {
+#pragma omp parallel for
+    for (int64_t j = 0; j < ny; j++) {
+      const float *y_j = y + j * dim;
+      float *dst = panels.data() + (j / IP_KERNEL_LANES) * dim * IP_KERNEL_LANES +
+                   j % IP_KERNEL_LANES;
+      for (int64_t d = 0; d < dim; d++) {
+        dst[d * IP_KERNEL_LANES] = y_j[d];
+      }
+      norms[j] = IP<const float, const float, float>(y_j, y_j, dim);
+    }
+    max_norm =
+        ny == 0 ? 0 : *std::max_element(norms.begin(), norms.begin() + ny);
+  }
+
+  int64_t dim;
+  int64_t ny;
+  int64_t npanel;
+  std::vector<float> panels;
+  std::vector<float> norms;
+  // the largest squared norm of a centroid
+  float max_norm;
+};
+
+// nearest centroid of the points rows[0..n) of x (the first n points if rows
+// is null), found by minimizing ||y||^2 - 2 x.y. a tile of points is run
+// against every panel while the panel stays in L1. if second is given it
+// gets a lower bound of the squared distance to every other centroid: the
+// decomposition loses up to about dim * eps * (||x||^2 + ||y||^2) to
+// cancellation, the second smallest value is lowered by twice that.
+template <typename T1>
+void packed_L2_scan(const T1 *x, const int64_t *rows, int64_t n,
+                    const PackedCentroids &packed, int64_t *ids,
+                    float *second) {
+  const int64_t dim = packed.dim;
+  const int64_t bs_x = 64;
+#pragma omp parallel
+  {
+    // integer points are widened to float once per tile
+    std::vector<float> xf(bs_x * dim);
+    std::vector<float> best_val(bs_x);
+    std::vector<float> second_val(bs_x);
+    std::vector<int64_t> best_id(bs_x);
+    float out[IP_KERNEL_ROWS * IP_KERNEL_LANES];
+
+#pragma omp for schedule(static)
+    for (int64_t i0 = 0; i0 < n; i0 += bs_x) {
+      const int64_t m = std::min(bs_x, n - i0);
+      const int64_t m_pad =
+          (m + IP_KERNEL_ROWS - 1) / IP_KERNEL_ROWS * IP_KERNEL_ROWS;
+      for (int64_t i = 0; i < m; i++) {
+        const T1 *x_i = x + (rows ? rows[i0 + i] : i0 + i) * dim;
+        for (int64_t d = 0; d < dim; d++) {
+          xf[i * dim + d] = (float)x_i[d];
+        }
+      }
+      std::fill(xf.begin() + m * dim, xf.begin() + m_pad * dim, 0.0f);
+      std::fill(best_val.begin(), best_val.end(),
+                std::numeric_limits<float>::infinity());
+      std::fill(second_val.begin(), second_val.end(),
+                std::numeric_limits<float>::infinity());
+      std::fill(best_id.begin(), best_id.end(), 0);
+
+      for (int64_t p = 0; p < packed.npanel; p++) {
+        const float *panel = packed.panels.data() + p * dim * IP_KERNEL_LANES;
+        const float *panel_norm = packed.norms.data() + p * IP_KERNEL_LANES;
+        for (int64_t r0 = 0; r0 < m_pad; r0 += IP_KERNEL_ROWS) {
+          ip_kernel(xf.data() + r0 * dim, panel, dim, out);
+          for (int64_t r = 0; r < IP_KERNEL_ROWS; r++) {
+            for (int64_t l = 0; l < IP_KERNEL_LANES; l++) {
+              float v = panel_norm[l] - 2 * out[r * IP_KERNEL_LANES + l];
+              if (v < second_val[r0 + r]) {
+                if (v < best_val[r0 + r]) {
+                  second_val[r0 + r] = best_val[r0 + r];
+                  best_val[r0 + r] = v;
+                  best_id[r0 + r] = p * IP_KERNEL_LANES + l;
+                } else {
+                  second_val[r0 + r] = v;
+                }
+              }
+            }
+          }
+        }
+      }
+
+      for (int64_t i = 0; i < m; i++) {
+        ids[i0 + i] = best_id[i];
+        if (second != nullptr) {
+          const float *xf_i = xf.data() + i * dim;
+          const float x_norm =
+              IP<const float, const float, float>(xf_i, xf_i, dim);
+          const float slack = 2 * dim * std::numeric_limits<float>::epsilon() *
+                              (x_norm + packed.max_norm);
+          second[i0 + i] = std::max(0.0f, second_val[i] + x_norm - slack);
+        }
+      }
+    }
+  }
+}
+
 // avg_len:
 //    0: not to normalize
 //    else: normalize
@@ -23,28 +192,51 @@ template <typename T>
 void compute_centroids(int64_t dim, int64_t k, int64_t n, const T *x,
                        const int64_t *assign, int64_t *hassign,
                        float *centroids, float avg_len = 0.0) {
-  memset(hassign, 0, sizeof(int64_t) * k);
-  memset(centroids, 0, sizeof(float) * dim * k);
-
-#pragma omp parallel
-  {
-    int64_t nt = omp_get_num_threads();
-    int64_t rank = omp_get_thread_num();
-
-    // this thread is taking care of centroids c0:c1
-    int64_t c0 = (k * rank) / nt;
-    int64_t c1 = (k * (rank + 1)) / nt;
-
-    for (int64_t i = 0; i < n; i++) {
+  // integer data is summed exactly
+  using AccT = typename std::conditional<std::is_integral<T>::value, int64_t,
+                                         float>::type;
+
+  // every part sums a contiguous range of points into its own buffer, the
+  // buffers are reduced afterwards. the number of parts is bounded so the
+  // buffers stay small against the points they sum.
+  const int64_t buffer_size = k * dim;
+  int64_t nparts = std::min<int64_t>(omp_get_max_threads(), n / k);
+  nparts = std::min<int64_t>(
+      nparts, COMPUTE_CENTROIDS_BUFFER_BYTES / (buffer_size * sizeof(AccT)));
+  nparts = std::max<int64_t>(nparts, 1);
+  std::vector<AccT> sums(nparts * buffer_size, 0);
+  std::vector<int64_t> counts(nparts * k, 0);
+
+#pragma omp parallel for schedule(static, 1)
+  for (int64_t p = 0; p < nparts; p++) {
+    AccT *sum = sums.data() + p * buffer_size;
+    int64_t *count = counts.data() + p * k;
+    const int64_t i0 = n * p / nparts;
+    const int64_t i1 = n * (p + 1) / nparts;
+    for (int64_t i = i0; i < i1; i++) {
       int64_t ci = assign[i];
-      if (ci >= c0 && ci < c1) {
-        float *c = centroids + ci * dim;
-        const T *xi = x + i * dim;
-        for (int64_t j = 0; j < dim; j++) {
-          c[j] += xi[j];
-        }
-        hassign[ci]++;
+      AccT *c = sum + ci * dim;
+      const T *xi = x + i * dim;
+      for (int64_t j = 0; j < dim; j++) {
+        c[j] += xi[j];
       }
+      count[ci]++;
+    }
+  }
+
+#pragma omp parallel for
+  for (int64_t ci = 0; ci < k; ci++) {
+    float *c = centroids + ci * dim;
+    hassign[ci] = 0;
+    for (int64_t j = 0; j < dim; j++) {
+      c[j] = 0;
+    }
+    for (int64_t p = 0; p < nparts; p++) {
+      const AccT *sum = sums.data() + p * buffer_size + ci * dim;
+      for (int64_t j = 0; j < dim; j++) {
+        c[j] += sum[j];
+      }
+      hassign[ci] += counts[p * k + ci];
     }
   }
 
@@ -332,6 +524,27 @@ void elkan_L2_assign(const T1 *x, const T2 *y, int64_t dim, int64_t nx,
   free(data);
 }
 
+// Data type: T1
+// Distance type: R
+// ID type int64_t
+template <typename T1, typename R>
+void blocked_L2_assign(const T1 *x, const float *y, int64_t dim, int64_t nx,
+                       int64_t ny, int64_t *ids, R *val) {
+  if (nx == 0 || ny == 0) {
+    return;
+  }
+
+  PackedCentroids packed(y, dim, ny);
+  packed_L2_scan<T1>(x, nullptr, nx, packed, ids, nullptr);
+
+  // the decomposition loses precision to cancellation, the reported distance
+  // is computed directly
+#pragma omp parallel for
+  for (int64_t i = 0; i < nx; i++) {
+    val[i] = L2sqr<const T1, const float, R>(x + i * dim, y + ids[i] * dim, dim);
+  }
+}
+
 inline int64_t split_clusters(int64_t dim, int64_t k, int64_t n,
                               int64_t *hassign, float *centroids) {
   const double EPS = (1 / 1024.);
@@ -491,7 +704,8 @@ void kmeanspp(const DATAT *pdata, const int64_t nb, const int64_t dim,
 
 template <typename T>
 void kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k, float *centroids,
-            bool kmpp, float avg_len, int64_t niter, int64_t seed) {
+            bool kmpp, float avg_len, int64_t niter, int64_t seed,
+            bool bounded) {
   clock_t start, end;
   start = clock();
   if (k > 1000)
@@ -539,11 +753,71 @@ void kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k, float *centroids,
     }
   }
 
+  // Hamerly bounds: lower[i] bounds the distance of point i to every centroid
+  // but its own. a point is only rescanned when the distance to its own
+  // centroid exceeds both that bound and half the distance from its centroid
+  // to the nearest other one. the bounds are dropped after a split.
+  bool bounds_valid = false;
+  std::vector<float> lower(nx);
+  std::vector<float> old_centroids(k * dim);
+  std::vector<float> half_sep(k);
+  std::vector<int64_t> rows;
+  std::vector<int64_t> row_assign;
+  std::vector<float> row_second;
+
   float err = std::numeric_limits<float>::max();
   for (int64_t i = 0; i < niter; i++) {
 
-    elkan_L2_assign<T, float, float>(x_in, centroids, dim, nx, k, assign.get(),
-                                     dis.get());
+    PackedCentroids packed(centroids, dim, k);
+    if (!bounds_valid) {
+      packed_L2_scan<T>(x_in, nullptr, nx, packed, assign.get(), lower.data());
+#pragma omp parallel for
+      for (int64_t j = 0; j < nx; j++) {
+        lower[j] = sqrt(lower[j]);
+        dis[j] = L2sqr<const T, const float, float>(
+            x_in + j * dim, centroids + assign[j] * dim, dim);
+      }
+    } else {
+#pragma omp parallel for
+      for (int64_t c = 0; c < k; c++) {
+        float min_sep = std::numeric_limits<float>::max();
+        for (int64_t c2 = 0; c2 < k; c2++) {
+          if (c2 != c) {
+            min_sep = std::min(min_sep, L2sqr<const float, const float, float>(
+                                            centroids + c * dim,
+                                            centroids + c2 * dim, dim));
+          }
+        }
+        half_sep[c] = 0.5 * sqrt(min_sep);
+      }
+
+#pragma omp parallel for
+      for (int64_t j = 0; j < nx; j++) {
+        dis[j] = L2sqr<const T, const float, float>(
+            x_in + j * dim, centroids + assign[j] * dim, dim);
+      }
+      rows.clear();
+      for (int64_t j = 0; j < nx; j++) {
+        if (sqrt(dis[j]) > std::max(half_sep[assign[j]], lower[j])) {
+          rows.push_back(j);
+        }
+      }
+      const int64_t nrows = rows.size();
+      row_assign.resize(nrows);
+      row_second.resize(nrows);
+      packed_L2_scan<T>(x_in, rows.data(), nrows, packed, row_assign.data(),
+                        row_second.data());
+#pragma omp parallel for
+      for (int64_t r = 0; r < nrows; r++) {
+        const int64_t j = rows[r];
+        assign[j] = row_assign[r];
+        lower[j] = sqrt(row_second[r]);
+        dis[j] = L2sqr<const T, const float, float>(
+            x_in + j * dim, centroids + assign[j] * dim, dim);
+      }
+    }
+
+    memcpy(old_centroids.data(), centroids, sizeof(float) * k * dim);
     compute_centroids<T>(dim, k, nx, x_in, assign.get(), hassign.get(),
                          centroids, avg_len);
 
@@ -552,7 +826,29 @@ void kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k, float *centroids,
                                         assign.get(), centroids, avg_len);
     if (split != 0) {
       // printf("split %ld\n", split);
+      bounds_valid = false;
     } else {
+      // every other centroid moved by at most the largest drift, or the
+      // second largest for the points of the centroid that drifted most
+      float max_drift = 0, second_drift = 0;
+      int64_t max_c = -1;
+      for (int64_t c = 0; c < k; c++) {
+        float drift = sqrt(L2sqr<const float, const float, float>(
+            old_centroids.data() + c * dim, centroids + c * dim, dim));
+        if (drift > max_drift) {
+          second_drift = max_drift;
+          max_drift = drift;
+          max_c = c;
+        } else if (drift > second_drift) {
+          second_drift = drift;
+        }
+      }
+#pragma omp parallel for
+      for (int64_t j = 0; j < nx; j++) {
+        lower[j] -= assign[j] == max_c ? second_drift : max_drift;
+      }
+      bounds_valid = bounded;
+
       float cur_err = 0.0;
       for (auto j = 0; j < nx; j++)
         cur_err += dis[j];
@@ -599,15 +895,14 @@ void non_recursive_multilevel_kmeans(
     uint32_t threshold,      // determines when to stop recursive clustering
     const uint64_t blk_size, // general 4096, determines how many vectors can be
                              // placed in a block
-    uint32_t
-        &blk_num, // output variable, num block output in this round clustering
-    IOWriter &data_writer,         // file writer 1: to output base vectors
-    IOWriter &centroids_writer,    // file writer 2: to output centroid vectors
-    IOWriter &centroids_id_writer, // file writer 3: to output centroid ids
-    int64_t
-        centroids_id_start_position, // the start position of all centroids id
-    int level,         // n-th round recursive clustering, start with 0
-    std::mutex &mutex, // mutex to protect write out centroids
+    std::atomic<uint32_t> &blk_num, // in/out: num blocks reserved for this
+                                    // K1 cluster, a block takes the next index
+    PositionalWriter &data_writer,  // file writer 1: to output base vectors
+    PositionalWriter &centroids_writer, // file writer 2: to output centroid
+                                        // vectors
+    PositionalWriter &centroids_id_writer, // file writer 3: to output centroid
+                                           // ids
+    int level, // n-th round recursive clustering, start with 0
     std::vector<ClusteringTask> &output_tasks, // output clustering tasks
     bool vector_use_sq,      // whether use scalar quantization on base vector
     std::vector<T> &max_len, // the max value on each dimension
@@ -692,9 +987,9 @@ void non_recursive_multilevel_kmeans(
                                       cluster_size, k2, weight,
                                       cluster_id.data(), dists.data());
     } else {
-      elkan_L2_assign<T, float, float>(data, k2_centroids.data(), dim,
-                                       cluster_size, k2, cluster_id.data(),
-                                       dists.data());
+      blocked_L2_assign<T, float>(data, k2_centroids.data(), dim,
+                                  cluster_size, k2, cluster_id.data(),
+                                  dists.data());
     }
 
     // dists is useless, so delete first
@@ -725,19 +1020,24 @@ void non_recursive_multilevel_kmeans(
 
   // now, elems in bucket_pre_size is prefix sum
 
-  // reorder thr data and ids by their cluster id
-  T *x_temp = new T[cluster_size * dim];
-  uint32_t *ids_temp = new uint32_t[cluster_size];
-  int64_t offest;
-  memcpy(x_temp, data, cluster_size * vector_size);
-  memcpy(ids_temp, ids, cluster_size * id_size);
-  for (int i = 0; i < cluster_size; i++) {
-    offest = (bucket_pre_size[cluster_id[i]]++);
-    ids[offest] = ids_temp[i];
-    memcpy(data + offest * dim, x_temp + i * dim, vector_size);
+  // reorder the data and ids by their cluster id in place, every vector is
+  // swapped straight into the next free slot of its cluster
+  std::vector<int64_t> bucket_end(bucket_pre_size.begin() + 1,
+                                  bucket_pre_size.end());
+  for (int64_t b = 0; b < k2; b++) {
+    while (bucket_pre_size[b] < bucket_end[b]) {
+      const int64_t i = bucket_pre_size[b];
+      const int64_t c = cluster_id[i];
+      if (c == b) {
+        bucket_pre_size[b]++;
+        continue;
+      }
+      const int64_t j = bucket_pre_size[c]++;
+      std::swap_ranges(data + i * dim, data + (i + 1) * dim, data + j * dim);
+      std::swap(ids[i], ids[j]);
+      std::swap(cluster_id[i], cluster_id[j]);
+    }
   }
-  delete[] x_temp;
-  delete[] ids_temp;
 
   // std::cout << "step 2: reorder data by cluster id: " << std::endl;
 
@@ -752,6 +1052,7 @@ void non_recursive_multilevel_kmeans(
   // repeated[vector, id], in-memory layout is repeated[vector] and repeated[id]
   char *data_blk_buf = new char[blk_size];
   std::vector<uint8_t> codes(threshold * dim, 0);
+  std::vector<T> centroid_T(dim);
 
   // check each k2 cluster, persistent or split again
   for (int i = 0; i < k2; i++) {
@@ -810,45 +1111,26 @@ void non_recursive_multilevel_kmeans(
         }
       }
 
-      // need a lock
-      {
-        std::lock_guard<std::mutex> lock(mutex);
-
-        // used to calculate how many centroids has been added
-        int64_t current_position = centroids_id_writer.get_position();
-        assert(current_position != -1);
-        // std::cout << "global_centroids_number: current_position: " <<
-        // current_position << std::endl;
-
-        // the k-th block in this file
-        int64_t local_block_index =
-            (current_position - centroids_id_start_position) / sizeof(uint32_t);
+      // reserve the next block of this K1 cluster, the block, its centroid
+      // and its id are written at the offsets of that index
+      uint64_t local_block_index = blk_num++;
 
-        // make sure type cast safety
-        assert(local_block_index >= 0);
+      uint32_t global_id = bbann::util::gen_global_block_id(
+          k1_id, (uint32_t)local_block_index);
 
-        uint32_t global_id = bbann::util::gen_global_block_id(
-            k1_id, (uint32_t)local_block_index);
+      // persistent a block
+      data_writer.write_at(data_blk_buf, blk_size,
+                           local_block_index * blk_size);
 
-        // persistent a block
-        data_writer.write((char *)data_blk_buf, blk_size);
-
-        // FIXME: ????????????????????????
-        // convert centroids to specified datatype
-        if (sizeof(T) != sizeof(float)) {
-          T *k2_centroids_T = new T[dim];
-          for (int j = 0; j < dim; j++) {
-            k2_centroids_T[j] = (T)k2_centroids[i * dim + j];
-          }
-          centroids_writer.write((char *)k2_centroids_T, sizeof(T) * dim);
-          delete[] k2_centroids_T;
-        } else {
-          centroids_writer.write((char *)(k2_centroids.data() + i * dim),
-                                 sizeof(float) * dim);
-        }
-
-        centroids_id_writer.write((char *)(&global_id), sizeof(uint32_t));
+      // convert centroids to specified datatype
+      for (int j = 0; j < dim; j++) {
+        centroid_T[j] = (T)k2_centroids[i * dim + j];
       }
+      centroids_writer.write_at((char *)centroid_T.data(), vector_size,
+                                local_block_index * vector_size);
+
+      centroids_id_writer.write_at((char *)(&global_id), id_size,
+                                   local_block_index * id_size);
     } else {
       output_tasks.emplace_back(
           ClusteringTask(round_offset + bucket_offset, bucket_size, level + 1));
@@ -860,77 +1142,112 @@ void non_recursive_multilevel_kmeans(
   //           std::endl;
 }
 
+// the m nearest centroids of every point, nearest first, and the distance of
+// every point to its assigned centroid if assign is given. with dis_tab the
+// distances to all k centroids are kept there, nx * k of them.
 template <typename T>
-void ssk_compute_dist_tab(int64_t nx, const T *x_in, int64_t dim, int64_t k,
-                          const float *centroids, float *dis_tab) {
-#pragma omp parallel for
-  for (int64_t i = 0; i < nx; ++i) {
-    const T *x = x_in + i * dim;
-    const int64_t ii = i * k;
-    for (int64_t j = 0; j < k; ++j) {
-      dis_tab[ii + j] =
-          L2sqr<const T, const float, float>(x, centroids + j * dim, dim);
+void ssk_compute_candidates(int64_t nx, const T *x_in, int64_t dim, int64_t k,
+                            int64_t m, const float *centroids,
+                            int64_t *cand_ids, float *cand_dis,
+                            const int64_t *assign = nullptr,
+                            float *cur_dis = nullptr,
+                            float *dis_tab = nullptr) {
+#pragma omp parallel
+  {
+    std::vector<float> row(dis_tab == nullptr ? k : 0);
+    std::vector<int64_t> order(k);
+#pragma omp for
+    for (int64_t i = 0; i < nx; ++i) {
+      const T *x = x_in + i * dim;
+      float *dis = dis_tab == nullptr ? row.data() : dis_tab + i * k;
+      for (int64_t j = 0; j < k; ++j) {
+        dis[j] = L2sqr<const T, const float, float>(x, centroids + j * dim, dim);
+        order[j] = j;
+      }
+      auto closer = [&](const auto &a, const auto &b) {
+        return dis[a] < dis[b];
+      };
+      if (m == k) {
+        std::sort(order.begin(), order.end(), closer);
+      } else {
+        std::partial_sort(order.begin(), order.begin() + m, order.end(),
+                          closer);
+      }
+      for (int64_t j = 0; j < m; ++j) {
+        cand_ids[i * m + j] = order[j];
+        cand_dis[i * m + j] = dis[order[j]];
+      }
+      if (assign != nullptr) {
+        cur_dis[i] = dis[assign[i]];
+      }
     }
   }
 }
 
-void ssk_init_assign(int64_t nx, int64_t k, uint64_t max_target_size,
-                     const float *dis_tab, int64_t *hassign, int64_t *assign) {
-  uint64_t remain = nx;
-  std::vector<float> min_max_dist_diff(nx);
+// capacitated assignment, the points with the largest spread between their
+// nearest and farthest open candidate are placed first. a point whose
+// candidates are all full falls back to a scan over all open centroids.
+template <typename T>
+void ssk_init_assign(int64_t nx, const T *x_in, int64_t dim, int64_t k,
+                     int64_t m, const float *centroids,
+                     uint64_t max_target_size, const int64_t *cand_ids,
+                     const float *cand_dis, int64_t *hassign,
+                     int64_t *assign) {
+  using Entry = std::pair<float, int64_t>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
   std::vector<int64_t> min_cluster_ids(nx);
-  bool idx = 0;
-  // rotate vector each iteration
-  std::vector<std::vector<int64_t>> points(2, std::vector<int64_t>(nx));
-
-  for (int64_t i = 0; i < nx; ++i) {
-    points[idx][i] = i;
-  }
 
-  while (remain) {
-    for (int64_t i = 0; i < remain; ++i) {
-      float min_dis = std::numeric_limits<float>::max();
-      float max_dis = 0;
-      int64_t min_cluster_id = -1;
-      const auto x = points[idx][i];
-
-      for (int64_t j = 0; j < k; ++j) {
-        if (hassign[j] < max_target_size) {
-          auto dis = dis_tab[x * k + j];
+  // the key of a point only grows as centroids fill up, a stale key popped
+  // from the queue is recomputed and pushed back
+  auto push = [&](int64_t x) {
+    float min_dis = std::numeric_limits<float>::max();
+    float max_dis = 0;
+    int64_t min_cluster_id = -1;
+    for (int64_t j = 0; j < m; ++j) {
+      const auto c = cand_ids[x * m + j];
+      if (hassign[c] < max_target_size) {
+        if (min_cluster_id == -1) {
+          min_dis = cand_dis[x * m + j];
+          min_cluster_id = c;
+        }
+        max_dis = cand_dis[x * m + j];
+      }
+    }
+    if (min_cluster_id == -1) {
+      const T *p = x_in + x * dim;
+      for (int64_t c = 0; c < k; ++c) {
+        if (hassign[c] < max_target_size) {
+          auto dis =
+              L2sqr<const T, const float, float>(p, centroids + c * dim, dim);
           if (dis < min_dis) {
             min_dis = dis;
-            min_cluster_id = j;
+            min_cluster_id = c;
           }
           max_dis = std::max(max_dis, dis);
         }
       }
-      // this should not happen as the max_target_size is a ceiling
-      // so there is at least one of the clusters could fit the vector
-      assert(min_cluster_id != -1);
-      min_cluster_ids[x] = min_cluster_id;
-      min_max_dist_diff[x] = min_dis - max_dis;
     }
+    // this should not happen as the max_target_size is a ceiling
+    // so there is at least one of the clusters could fit the vector
+    assert(min_cluster_id != -1);
+    min_cluster_ids[x] = min_cluster_id;
+    queue.emplace(min_dis - max_dis, x);
+  };
 
-    std::sort(points[idx].begin(), points[idx].begin() + remain,
-              [&](const auto &x, const auto &y) {
-                return min_max_dist_diff[x] < min_max_dist_diff[y];
-              });
-
-    int64_t j = 0;
-    for (int64_t i = 0; i < remain; ++i) {
-      const auto x = points[idx][i];
-      const auto c = min_cluster_ids[x];
+  for (int64_t i = 0; i < nx; ++i) {
+    push(i);
+  }
 
-      if (hassign[c] < max_target_size) {
-        assign[x] = c;
-        ++hassign[c];
-      } else {
-        points[!idx][j++] = x;
-      }
+  while (!queue.empty()) {
+    const auto x = queue.top().second;
+    queue.pop();
+    const auto c = min_cluster_ids[x];
+    if (hassign[c] < max_target_size) {
+      assign[x] = c;
+      ++hassign[c];
+    } else {
+      push(x);
     }
-
-    remain = j;
-    idx = !idx;
   }
 }
 
@@ -978,16 +1295,28 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
     }
   }
 
-  float *dis_tab = new float[nx * k];
-  assert(dis_tab != nullptr);
-
-  ssk_compute_dist_tab(nx, x_in, dim, k, centroids, dis_tab);
+  // a small problem keeps the full nx * k distance table and every centroid
+  // is a candidate. a large one keeps only the m nearest centroids of every
+  // point and computes the other distances on demand.
+  const bool dense =
+      k <= 2 * SSK_CANDIDATES_NUM || nx * k <= SSK_DENSE_TABLE_MAX;
+  const int64_t m = dense ? k : SSK_CANDIDATES_NUM;
+  std::vector<int64_t> cand_ids(nx * m);
+  std::vector<float> cand_dis(nx * m);
+  std::vector<float> dis_tab(dense ? nx * k : 0);
+  float *dis_tab_ptr = dense ? dis_tab.data() : nullptr;
+  // distance of every point to its assigned centroid
+  std::vector<float> cur_dis(nx);
+
+  ssk_compute_candidates(nx, x_in, dim, k, m, centroids, cand_ids.data(),
+                         cand_dis.data(), nullptr, nullptr, dis_tab_ptr);
 
 #ifdef SSK_LOG
-  std::cout << "init compute dis_tab done" << std::endl;
+  std::cout << "init compute candidates done" << std::endl;
 #endif
 
-  ssk_init_assign(nx, k, max_target_size, dis_tab, hassign, assign);
+  ssk_init_assign(nx, x_in, dim, k, m, centroids, max_target_size,
+                  cand_ids.data(), cand_dis.data(), hassign, assign);
 
 #ifdef SSK_LOG
   std::cout << "Initialization done" << std::endl;
@@ -997,22 +1326,20 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
   for (int64_t i = 0; i < nx; ++i) {
     xs[i] = i;
   }
+  std::vector<float> delta_cur_best(nx);
 
-  int64_t *ks = new int64_t[k];
-  for (int64_t i = 0; i < k; ++i) {
-    ks[i] = i;
-  }
-
-  auto delta_cur_best = [&](const auto &x) {
-    float min_dis = std::numeric_limits<float>::max();
-    for (int64_t i = 0; i < k; ++i) {
-      min_dis = std::min(min_dis, dis_tab[x * k + i]);
+  // distance of point x to centroid c, computed if c is not a candidate
+  auto dist_to = [&](const auto &x, int64_t c) {
+    if (dense) {
+      return dis_tab[x * k + c];
     }
-    return dis_tab[x * k + assign[x]] - min_dis;
-  };
-
-  auto gain = [&](const auto &x, int64_t i) {
-    return dis_tab[x * k + assign[x]] - dis_tab[x * k + i];
+    for (int64_t j = 0; j < m; ++j) {
+      if (cand_ids[x * m + j] == c) {
+        return cand_dis[x * m + j];
+      }
+    }
+    return L2sqr<const T, const float, float>(x_in + x * dim,
+                                              centroids + c * dim, dim);
   };
 
   compute_centroids(dim, k, nx, x_in, assign, hassign, centroids, avg_len);
@@ -1026,31 +1353,38 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
 #endif
 
     int64_t transfer_cnt = 0;
-    ssk_compute_dist_tab(nx, x_in, dim, k, centroids, dis_tab);
+    ssk_compute_candidates(nx, x_in, dim, k, m, centroids, cand_ids.data(),
+                           cand_dis.data(), assign, cur_dis.data(),
+                           dis_tab_ptr);
 
+    for (int64_t i = 0; i < nx; ++i) {
+      delta_cur_best[i] = cur_dis[i] - cand_dis[i * m];
+    }
     std::sort(xs, xs + nx, [&](const auto &x, const auto &y) {
-      return delta_cur_best(x) > delta_cur_best(y);
+      return delta_cur_best[x] > delta_cur_best[y];
     });
 
     for (int64_t i = 0; i < nx; ++i) {
       const auto x = xs[i];
       int64_t x_cluster = assign[x];
-      std::sort(ks, ks + k, [&](const auto &a, const auto &b) {
-        return gain(x, a) > gain(x, b);
-      });
 
-      for (int64_t j = 0; j < k; ++j) {
+      // the candidates are in order of decreasing gain
+      for (int64_t jj = 0; jj < m; ++jj) {
+        const int64_t j = cand_ids[x * m + jj];
         if (j == assign[x])
           continue;
 
-        float x_gain = gain(x, j);
+        float x_gain = cur_dis[x] - cand_dis[x * m + jj];
 
         for (int64_t v = 0; v < transfer_lists[j].size(); ++v) {
           const int64_t candidate = transfer_lists[j][v];
+          const float candidate_dis = dist_to(candidate, x_cluster);
 
-          if (x_gain + gain(candidate, x_cluster) > 0) {
+          if (x_gain + cur_dis[candidate] - candidate_dis > 0) {
             std::swap(assign[x], assign[candidate]);
             x_cluster = assign[x];
+            cur_dis[x] = cand_dis[x * m + jj];
+            cur_dis[candidate] = candidate_dis;
             transfer_lists[j].erase(transfer_lists[j].begin() + v);
             transfer_cnt += 2;
 
@@ -1065,12 +1399,12 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
           ++hassign[j];
           assign[x] = j;
           x_cluster = j;
+          cur_dis[x] = cand_dis[x * m + jj];
           ++transfer_cnt;
         }
       }
 
-      if (assign[x] != ks[0] &&
-          dis_tab[x * k + assign[x]] > dis_tab[x * k + ks[0]]) {
+      if (assign[x] != cand_ids[x * m] && cur_dis[x] > cand_dis[x * m]) {
         transfer_lists[assign[x]].push_back(x);
       }
     }
@@ -1083,7 +1417,7 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
 
     float cur_err = 0.0;
     for (auto i = 0; i < nx; ++i) {
-      cur_err += dis_tab[i * k + assign[i]];
+      cur_err += cur_dis[i];
     }
 #ifdef SSK_LOG
     std::cout << "Transfered " << transfer_cnt << ", skipped " << skip_cnt
@@ -1117,9 +1451,7 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
 #endif
 
   delete[] xs;
-  delete[] ks;
 
-  delete[] dis_tab;
   delete[] hassign;
 }
 
@@ -1127,15 +1459,14 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
   template void kmeans<T>(int64_t nx, const T *x_in, int64_t dim, int64_t k,   \
                           float *centroids, bool kmpp = false,                 \
                           float avg_len = 0.0, int64_t niter = 10,             \
-                          int64_t seed = 1234);                                \
+                          int64_t seed = 1234, bool bounded = true);           \
   template void non_recursive_multilevel_kmeans<T>(                            \
       uint32_t k1_id, int64_t cluster_size, T * data, uint32_t * ids,          \
       int64_t round_offset, int64_t dim, uint32_t threshold,                   \
-      const uint64_t blk_size, uint32_t &blk_num, /* IOWriter */               \
-      IOWriter &data_writer, IOWriter &centroids_writer,                       \
-      IOWriter                                                                 \
-          &centroids_id_writer, /* parameters for multi-thread accelerate */   \
-      int64_t centroids_id_start_position, int level, std::mutex &mutex,       \
+      const uint64_t blk_size, std::atomic<uint32_t> &blk_num,                 \
+      /* PositionalWriter */ PositionalWriter &data_writer,                    \
+      PositionalWriter &centroids_writer,                                      \
+      PositionalWriter &centroids_id_writer, int level,                        \
       std::vector<ClusteringTask>                                              \
           &output_tasks, /* SQ encode on base vectors */                       \
       bool vector_use_sq, std::vector<T> &max_len,                             \
@@ -1148,7 +1479,10 @@ void same_size_kmeans(int64_t nx, const T *x_in, int64_t dim, int64_t k,
 #define IVF_T(T1, T2, R)                                                       \
   template void elkan_L2_assign<T1, T2, R>(const T1 *x, const T2 *y,           \
                                            int64_t dim, int64_t nx,            \
-                                           int64_t ny, int64_t *ids, R *val);
+                                           int64_t ny, int64_t *ids, R *val); \
+  template void blocked_L2_assign<T1, R>(const T1 *x, const float *y,          \
+                                         int64_t dim, int64_t nx, int64_t ny,  \
+                                         int64_t *ids, R *val);
 
 IVF(uint8_t);
 IVF(int8_t);
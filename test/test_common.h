@@ -0,0 +1,105 @@
+#pragma once
+
+#include "lib/bbannlib2.h"
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// Helpers shared by the self-contained tests run by ctest. A test is a main()
+// that returns 0 on success, CHECK prints the failed condition and returns 1.
+
+#define CHECK(cond)                                                            \
+  if (!(cond)) {                                                               \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);            \
+    return 1;                                                                  \
+  }
+
+namespace test {
+
+// A fresh directory /tmp/<name>.XXXXXX, removed with everything in it when
+// the object goes out of scope.
+class TempDir {
+public:
+  explicit TempDir(const std::string &name) {
+    std::string pattern = "/tmp/" + name + ".XXXXXX";
+    std::vector<char> buf(pattern.begin(), pattern.end());
+    buf.push_back('\0');
+    if (mkdtemp(buf.data()) == nullptr) {
+      perror("mkdtemp");
+      exit(-1);
+    }
+    path_ = buf.data();
+  }
+
+  ~TempDir() { std::filesystem::remove_all(path_); }
+
+  // the path of a file in the directory
+  std::string file(const std::string &name) const { return path_ + "/" + name; }
+
+  const std::string &path() const { return path_; }
+
+private:
+  std::string path_;
+};
+
+// n uint8 vectors of dim uniformly random values, the same for the same seed.
+inline std::vector<uint8_t> random_vectors(uint64_t n, uint32_t dim,
+                                           uint32_t seed) {
+  std::mt19937 generator(seed);
+  std::vector<uint8_t> data(n * dim);
+  for (auto &x : data) {
+    x = generator() % 256;
+  }
+  return data;
+}
+
+// write the vectors as a .u8bin file: n and dim as uint32, then the values
+inline void write_u8bin(const std::string &file, const std::vector<uint8_t> &data,
+                        uint32_t n, uint32_t dim) {
+  std::ofstream writer(file, std::ios::binary);
+  writer.write((char *)&n, sizeof(uint32_t));
+  writer.write((char *)&dim, sizeof(uint32_t));
+  writer.write((char *)data.data(), (uint64_t)n * dim);
+}
+
+// parameters of a small L2 index over a .u8bin file, built into prefix.
+// nProbe covers every bucket, so a base vector used as query finds itself.
+inline bbann::BBAnnParameters small_index_para(const std::string &data_file,
+                                               const std::string &prefix) {
+  bbann::BBAnnParameters para;
+  para.dataFilePath = data_file;
+  para.indexPrefixPath = prefix;
+  para.metric = MetricType::L2;
+  para.K1 = 4;
+  para.blockSize = 4096;
+  para.hnswM = 16;
+  para.hnswefC = 100;
+  para.nProbe = 256;
+  para.efSearch = 256;
+  return para;
+}
+
+// number of answers of the knn search of the queries that are in ids
+inline uint64_t count_found(bbann::BBAnnIndex2<uint8_t, uint32_t> &index,
+                            const bbann::BBAnnParameters &para,
+                            const std::vector<uint8_t> &query, uint32_t dim,
+                            uint64_t knn, const std::vector<uint32_t> &ids) {
+  uint64_t nq = query.size() / dim;
+  std::vector<uint32_t> answer_ids(nq * knn);
+  std::vector<uint32_t> answer_dists(nq * knn);
+  index.BatchSearchCpp(query.data(), dim, nq, knn, para, answer_ids.data(),
+                       answer_dists.data());
+  std::set<uint32_t> wanted(ids.begin(), ids.end());
+  uint64_t found = 0;
+  for (auto id : answer_ids) {
+    found += wanted.count(id);
+  }
+  return found;
+}
+
+} // namespace test
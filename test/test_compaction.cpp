@@ -0,0 +1,161 @@
+#include "test_common.h"
+#include "util/file_handler.h"
+#include "util/utils_inline.h"
+#include <algorithm>
+
+using bbann::BBAnnIndex2;
+
+const uint32_t nb = 20000;
+const uint32_t nq = 100;
+const uint32_t dim = 16;
+const uint64_t knn = 10;
+const uint32_t inserted_base = 1000000;
+
+// the ids in a file of n, 1 and n ids
+std::set<uint32_t> read_ids(const std::string &ids_file) {
+  IOReader reader(ids_file);
+  uint32_t n, ids_dim;
+  reader.read((char *)&n, sizeof(uint32_t));
+  reader.read((char *)&ids_dim, sizeof(uint32_t));
+  auto ids = (const uint32_t *)reader.view((uint64_t)n * sizeof(uint32_t));
+  return std::set<uint32_t>(ids, ids + n);
+}
+
+int main() {
+  test::TempDir dir("test_compaction");
+  std::string prefix = dir.path() + "/";
+
+  // a small index, the queries are copies of base vectors
+  std::vector<uint8_t> base = test::random_vectors(nb, dim, 11);
+  std::vector<uint8_t> query(base.begin(), base.begin() + nq * dim);
+  test::write_u8bin(dir.file("base.u8bin"), base, nb, dim);
+  auto para = test::small_index_para(dir.file("base.u8bin"), prefix);
+  BBAnnIndex2<uint8_t, uint32_t>::BuildIndex(para);
+
+  std::vector<uint32_t> first(nq / 2), second(nq / 2), inserted(nq);
+  for (uint32_t i = 0; i < nq / 2; i++) {
+    first[i] = i;
+    second[i] = nq / 2 + i;
+  }
+  for (uint32_t i = 0; i < nq; i++) {
+    inserted[i] = inserted_base + i;
+  }
+
+  // the ids of a block of cluster 0 without queries, all deleted to empty
+  // its bucket
+  std::vector<uint32_t> bucket;
+  uint32_t bucket_bid = 0;
+  {
+    IOReader reader(bbann::getClusterRawDataFileName(prefix, 0));
+    const uint64_t blk_num = reader.get_file_size() / para.blockSize;
+    for (; bucket_bid < blk_num; bucket_bid++) {
+      const char *blk = reader.view(para.blockSize);
+      const uint32_t num = *(const uint32_t *)blk;
+      bucket.clear();
+      for (uint32_t k = 0; k < num; k++) {
+        bucket.push_back(*(const uint32_t *)(blk + sizeof(uint32_t) +
+                                             (dim + sizeof(uint32_t)) * k +
+                                             dim));
+      }
+      if (*std::min_element(bucket.begin(), bucket.end()) >= nq) {
+        break;
+      }
+    }
+    CHECK(bucket_bid < blk_num);
+  }
+  const uint64_t bucket_label = bbann::util::gen_id(0, bucket_bid, 0);
+
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    index.Delete(first.data(), first.size());
+    index.Delete(bucket.data(), bucket.size());
+  }
+
+  // compaction drops the deleted vectors from the blocks, the emptied bucket
+  // leaves the router
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(index.Compact(para));
+    CHECK(index.deleted_->count() == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, first) == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, second) == nq / 2);
+    auto it = index.index_hnsw_->label_lookup_.find(bucket_label);
+    CHECK(it != index.index_hnsw_->label_lookup_.end());
+    CHECK(index.index_hnsw_->isMarkedDeleted(it->second));
+    index.Insert(query.data(), inserted.data(), nq);
+  }
+
+  // and moves the inserts into the blocks. the compacted files are what a
+  // reload serves.
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(index.delta_->size() == nq);
+    CHECK(index.Compact(para));
+    CHECK(index.delta_->size() == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, inserted) == nq);
+  }
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(index.delta_->size() == 0);
+    CHECK(index.deleted_->count() == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, first) == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, inserted) == nq);
+    auto it = index.index_hnsw_->label_lookup_.find(bucket_label);
+    CHECK(index.index_hnsw_->isMarkedDeleted(it->second));
+
+    // the bucket files list the live router nodes
+    std::set<uint32_t> centroid_ids = read_ids(prefix + "cluster-combine_ids.bin");
+    uint64_t live = 0;
+    for (auto &[label, internal_id] : index.index_hnsw_->label_lookup_) {
+      live += !index.index_hnsw_->isMarkedDeleted(internal_id);
+    }
+    CHECK(centroid_ids.size() == live);
+    CHECK(centroid_ids.count(bbann::util::gen_global_block_id(0, bucket_bid)) ==
+          0);
+    std::set<uint32_t> global_ids;
+    for (int cid = 0; cid < para.K1; cid++) {
+      auto ids = read_ids(bbann::getClusterGlobalIdsFileName(prefix, cid));
+      global_ids.insert(ids.begin(), ids.end());
+    }
+    CHECK(global_ids.size() == nb + nq - first.size() - bucket.size());
+    for (auto id : bucket) {
+      CHECK(global_ids.count(id) == 0);
+    }
+    for (auto id : inserted) {
+      CHECK(global_ids.count(id) == 1);
+    }
+
+    // a deletion after the reload is counted against its cluster
+    index.Delete(second.data(), second.size());
+    CHECK(index.Compact(para));
+    CHECK(test::count_found(index, para, query, dim, knn, second) == 0);
+    index.Delete(inserted.data(), inserted.size());
+  }
+
+  // a compaction that stopped after writing its journal is finished by the
+  // next load: here it replaces the deletion log with an empty one
+  std::string deleted_file = bbann::getDeletedIdsFileName(prefix);
+  std::string journal = bbann::getCompactJournalFileName(prefix);
+  CHECK(bbann::util::fsize(deleted_file) == inserted.size() * sizeof(uint32_t));
+  std::ofstream(deleted_file + ".compact", std::ios::binary).close();
+  {
+    std::ofstream writer(journal);
+    writer << deleted_file << std::endl;
+  }
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(access(journal.c_str(), F_OK) != 0);
+    CHECK(access((deleted_file + ".compact").c_str(), F_OK) != 0);
+    CHECK(bbann::util::fsize(deleted_file) == 0);
+    CHECK(index.deleted_->count() == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, inserted) == nq);
+  }
+
+  printf("test_compaction passed\n");
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "test_common.h"
+#include "util/deletion_bitmap.h"
+#include "util/utils_inline.h"
+
+using bbann::BBAnnIndex2;
+using bbann::DeletionBitmap;
+
+const uint32_t nb = 20000;
+const uint32_t nq = 100;
+const uint32_t dim = 16;
+const uint64_t knn = 10;
+
+int main() {
+  test::TempDir dir("test_deletion");
+
+  // the deleted ids are replayed from the log by a new bitmap
+  std::string log_file = dir.file("bitmap.bin");
+  uint32_t ids[] = {3, 64, 65, 1u << 31, 0xfffffffe};
+  {
+    DeletionBitmap deleted;
+    deleted.Open(log_file);
+    deleted.Delete(ids, 3);
+    deleted.Delete(ids + 3, 2);
+    CHECK(deleted.count() == 5);
+  }
+  {
+    DeletionBitmap deleted;
+    deleted.Open(log_file);
+    CHECK(deleted.count() == 5);
+    CHECK(deleted.log_size() == 5);
+    for (auto id : ids) {
+      CHECK(deleted.test(id));
+    }
+    CHECK(!deleted.test(4));
+    CHECK(!deleted.test(0xffffffff));
+  }
+
+  // a partial id torn by a crash is cut off the log, the following delete
+  // lands after the last whole id
+  {
+    std::ofstream writer(log_file, std::ios::binary | std::ios::app);
+    writer.write("\x07\x00", 2);
+  }
+  CHECK(bbann::util::fsize(log_file) == 5 * sizeof(uint32_t) + 2);
+  {
+    DeletionBitmap deleted;
+    deleted.Open(log_file);
+    CHECK(deleted.log_size() == 5);
+    CHECK(bbann::util::fsize(log_file) == 5 * sizeof(uint32_t));
+    uint32_t id = 123456;
+    deleted.Delete(&id, 1);
+  }
+  {
+    DeletionBitmap deleted;
+    deleted.Open(log_file);
+    CHECK(deleted.count() == 6);
+    CHECK(deleted.test(123456));
+  }
+
+  // deleted vectors of an index are hidden from the search, also after a
+  // reload. the queries are copies of base vectors.
+  std::vector<uint8_t> base = test::random_vectors(nb, dim, 11);
+  std::vector<uint8_t> query(base.begin(), base.begin() + nq * dim);
+  std::string prefix = dir.path() + "/";
+  test::write_u8bin(dir.file("base.u8bin"), base, nb, dim);
+  auto para = test::small_index_para(dir.file("base.u8bin"), prefix);
+  BBAnnIndex2<uint8_t, uint32_t>::BuildIndex(para);
+
+  std::vector<uint32_t> first(nq / 2), second(nq / 2);
+  for (uint32_t i = 0; i < nq / 2; i++) {
+    first[i] = i;
+    second[i] = nq / 2 + i;
+  }
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(test::count_found(index, para, query, dim, knn, first) == nq / 2);
+    index.Delete(first.data(), first.size());
+    CHECK(test::count_found(index, para, query, dim, knn, first) == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, second) == nq / 2);
+  }
+  {
+    BBAnnIndex2<uint8_t, uint32_t> index(MetricType::L2);
+    CHECK(index.LoadIndex(prefix, para));
+    CHECK(index.deleted_->count() == first.size());
+    CHECK(test::count_found(index, para, query, dim, knn, first) == 0);
+    CHECK(test::count_found(index, para, query, dim, knn, second) == nq / 2);
+  }
+
+  printf("test_deletion passed\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include "lib/delta_index.h"
+#include "test_common.h"
+#include "util/utils_inline.h"
+#include <fstream>
+
+using bbann::DeltaIndex;
+
+const uint32_t dim = 16;
+const uint64_t nb = 100;
+
+int main() {
+  test::TempDir dir("test_delta_wal");
+  std::string wal_file = dir.file("delta.wal");
+
+  std::vector<uint8_t> data = test::random_vectors(nb, dim, 7);
+  std::vector<uint32_t> ids(nb);
+  for (uint64_t i = 0; i < nb; i++) {
+    ids[i] = 1000 + i;
+  }
+
+  // two inserts are two records of the write-ahead file
+  {
+    DeltaIndex<uint8_t, uint32_t> delta(MetricType::L2, dim);
+    delta.Open(wal_file);
+    delta.Insert(data.data(), ids.data(), nb / 2);
+    delta.Insert(data.data() + nb / 2 * dim, ids.data() + nb / 2, nb / 2);
+    CHECK(delta.size() == nb);
+  }
+  const uint64_t wal_size = bbann::util::fsize(wal_file);
+
+  // the vectors come back from the file, every one is its own nearest
+  {
+    DeltaIndex<uint8_t, uint32_t> delta(MetricType::L2, dim);
+    delta.Open(wal_file);
+    CHECK(delta.size() == nb);
+    const uint64_t knn = 3;
+    std::vector<uint32_t> answer_ids(nb * knn);
+    std::vector<uint32_t> answer_dists(nb * knn);
+    delta.Search(data.data(), nb, knn, answer_ids.data(), answer_dists.data());
+    for (uint64_t i = 0; i < nb; i++) {
+      CHECK(answer_ids[i * knn] == ids[i]);
+      CHECK(answer_dists[i * knn] == 0);
+    }
+  }
+
+  // a record torn by a crash is dropped and cut off the file, the following
+  // insert lands after the last whole record
+  {
+    std::ofstream writer(wal_file, std::ios::binary | std::ios::app);
+    uint32_t torn[3] = {5, dim, 77};
+    writer.write((char *)torn, sizeof(torn));
+  }
+  CHECK(bbann::util::fsize(wal_file) == wal_size + 3 * sizeof(uint32_t));
+  {
+    DeltaIndex<uint8_t, uint32_t> delta(MetricType::L2, dim);
+    delta.Open(wal_file);
+    CHECK(delta.size() == nb);
+    CHECK(bbann::util::fsize(wal_file) == wal_size);
+    uint32_t id = 5000;
+    delta.Insert(data.data(), &id, 1);
+  }
+  {
+    DeltaIndex<uint8_t, uint32_t> delta(MetricType::L2, dim);
+    delta.Open(wal_file);
+    CHECK(delta.size() == nb + 1);
+    std::vector<uint8_t> snapshot;
+    std::vector<uint32_t> snapshot_ids;
+    CHECK(delta.Snapshot(snapshot, snapshot_ids) == nb + 1);
+    CHECK(snapshot_ids.back() == 5000);
+  }
+
+  printf("test_delta_wal passed\n");
+  return 0;
+}
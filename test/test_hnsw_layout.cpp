@@ -0,0 +1,89 @@
+#include "hnswlib/hnswalg.h"
+#include "hnswlib/space_ui8_l2.h"
+#include "test_common.h"
+
+using Index = hnswlib::HierarchicalNSW<uint32_t>;
+
+const uint32_t nb = 20000;
+const uint32_t nq = 500;
+const uint32_t dim = 32;
+const size_t knn = 10;
+const size_t ef = 64;
+
+struct Answers {
+  std::vector<hnswlib::labeltype> labels;
+  std::vector<uint32_t> dists;
+  bool operator==(const Answers &other) const {
+    return labels == other.labels && dists == other.dists;
+  }
+};
+
+Answers search(Index &index, const std::vector<uint8_t> &query) {
+  Answers answers;
+  answers.labels.resize(nq * knn);
+  answers.dists.resize(nq * knn);
+  index.setEf(ef);
+  for (uint32_t i = 0; i < nq; i++) {
+    index.searchKnn(query.data() + i * dim, knn, answers.dists.data() + i * knn,
+                    answers.labels.data() + i * knn);
+  }
+  return answers;
+}
+
+// The level 0 layouts only change how the graph is stored, a search returns
+// the same answers on all of them. reorderGraph renumbers the nodes,
+// compressLevel0 encodes the links and loadIndexMapped reads them from the
+// file.
+int main() {
+  test::TempDir dir("test_hnsw_layout");
+  std::string plain_file = dir.file("plain.bin");
+  std::string reordered_file = dir.file("reordered.bin");
+
+  std::vector<uint8_t> base = test::random_vectors(nb, dim, 5);
+  std::vector<uint8_t> query = test::random_vectors(nq, dim, 6);
+
+  hnswlib::L2Space<uint8_t, uint32_t> space(dim);
+  Answers expected;
+  {
+    Index index(&space, nb, 16, 100);
+    for (uint32_t i = 0; i < nb; i++) {
+      index.addPoint(base.data() + (uint64_t)i * dim, i);
+    }
+    index.saveIndex(plain_file);
+    expected = search(index, query);
+    index.reorderGraph();
+    CHECK(search(index, query) == expected);
+    index.saveIndex(reordered_file);
+    index.compressLevel0();
+    CHECK(search(index, query) == expected);
+  }
+
+  for (auto &file : {plain_file, reordered_file}) {
+    Index loaded(&space, file);
+    CHECK(search(loaded, query) == expected);
+    loaded.compressLevel0();
+    CHECK(search(loaded, query) == expected);
+
+    Index mapped(&space);
+    mapped.loadIndexMapped(file, &space);
+    CHECK(search(mapped, query) == expected);
+    mapped.compressLevel0();
+    CHECK(search(mapped, query) == expected);
+  }
+
+  // a failed mapping leaves an empty index that is safe to destroy
+  {
+    Index mapped(&space);
+    bool failed = false;
+    try {
+      mapped.loadIndexMapped(dir.file("missing.bin"), &space);
+    } catch (const std::exception &) {
+      failed = true;
+    }
+    CHECK(failed);
+    CHECK(mapped.cur_element_count == 0);
+  }
+
+  printf("test_hnsw_layout passed\n");
+  return 0;
+}
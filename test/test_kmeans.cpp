@@ -0,0 +1,54 @@
+#include "lib/ivf.h"
+#include "test_common.h"
+
+const int64_t nx = 20000;
+const int64_t niter = 25;
+
+// nx points spread evenly over blobs random centers, every value is at least
+// base and at most noise - 1 above its center
+std::vector<uint8_t> points(int64_t dim, int64_t blobs, int base, int noise) {
+  std::mt19937 generator(31);
+  std::vector<uint8_t> centers(blobs * dim);
+  for (auto &c : centers) {
+    c = base + generator() % (256 - base - noise + 1);
+  }
+  std::vector<uint8_t> x(nx * dim);
+  for (int64_t i = 0; i < nx; i++) {
+    const uint8_t *c = centers.data() + (i % blobs) * dim;
+    for (int64_t d = 0; d < dim; d++) {
+      x[i * dim + d] = c[d] + generator() % noise;
+    }
+  }
+  return x;
+}
+
+// kmeans with the Hamerly bounds against the loop that rescans every point:
+// the bounds may only skip points that keep their centroid, so every
+// iteration assigns the same and the centroids come out bit for bit equal.
+// the points sit far from the origin where the inner product decomposition
+// that seeds the bounds loses the most to cancellation. no cluster may run
+// empty, a split draws from a shared random generator and would make the two
+// runs differ.
+int main() {
+  struct Case {
+    int64_t dim, blobs, k;
+    int base, noise;
+  };
+  // uniform points in 128 dimensions, and tight blobs in 16 where the bounds
+  // prune the most
+  for (auto c : {Case{128, 1, 48, 150, 80}, Case{128, 1, 250, 150, 80},
+                 Case{16, 64, 48, 150, 24}}) {
+    std::vector<uint8_t> x = points(c.dim, c.blobs, c.base, c.noise);
+    for (int64_t seed : {1, 2, 3}) {
+      std::vector<float> bounded(c.k * c.dim), lloyd(c.k * c.dim);
+      kmeans<uint8_t>(nx, x.data(), c.dim, c.k, bounded.data(), false, 0.0,
+                      niter, seed, true);
+      kmeans<uint8_t>(nx, x.data(), c.dim, c.k, lloyd.data(), false, 0.0,
+                      niter, seed, false);
+      CHECK(bounded == lloyd);
+    }
+  }
+
+  printf("test_kmeans passed\n");
+  return 0;
+}
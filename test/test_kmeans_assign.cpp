@@ -0,0 +1,79 @@
+#include "lib/ivf.h"
+#include "test_common.h"
+#include "util/distance.h"
+
+// odd sizes, the last panel of centroids and the last tile of points are
+// partial
+const int64_t nx = 1001;
+const int64_t ny = 70;
+const int64_t dim = 100;
+
+float norm(const float *y) {
+  return IP<const float, const float, float>(y, y, dim);
+}
+
+double exact_L2(const uint8_t *x, const float *y) {
+  double dis = 0;
+  for (int64_t d = 0; d < dim; d++) {
+    dis += ((double)x[d] - y[d]) * ((double)x[d] - y[d]);
+  }
+  return dis;
+}
+
+// blocked_L2_assign against elkan_L2_assign. built once with the vectorized
+// inner product kernel and once as test_kmeans_assign_scalar with the scalar
+// one.
+int main() {
+  std::vector<uint8_t> x = test::random_vectors(nx, dim, 21);
+  std::vector<uint8_t> y8 = test::random_vectors(ny, dim, 22);
+
+  std::vector<int64_t> elkan_ids(nx), blocked_ids(nx);
+  std::vector<uint32_t> elkan_val(nx), blocked_val(nx);
+
+  // integer centroids: every product and sum stays below 2^24 so the
+  // decomposition is exact and both pick the same centroid, the lowest id on
+  // a tie
+  std::vector<float> y(y8.begin(), y8.end());
+  elkan_L2_assign<uint8_t, float, uint32_t>(x.data(), y.data(), dim, nx, ny,
+                                            elkan_ids.data(),
+                                            elkan_val.data());
+  blocked_L2_assign<uint8_t, uint32_t>(x.data(), y.data(), dim, nx, ny,
+                                       blocked_ids.data(), blocked_val.data());
+  CHECK(blocked_ids == elkan_ids);
+  CHECK(blocked_val == elkan_val);
+
+  // fractional centroids: a different pick is only allowed within the
+  // rounding error of the decomposition, val is the distance to the pick
+  for (int64_t j = 0; j < ny * dim; j++) {
+    y[j] = y8[j] + 0.37f * (j % 7) - 1.1f;
+  }
+  float max_norm = 0;
+  for (int64_t j = 0; j < ny; j++) {
+    max_norm = std::max(max_norm, norm(y.data() + j * dim));
+  }
+  elkan_L2_assign<uint8_t, float, uint32_t>(x.data(), y.data(), dim, nx, ny,
+                                            elkan_ids.data(),
+                                            elkan_val.data());
+  blocked_L2_assign<uint8_t, uint32_t>(x.data(), y.data(), dim, nx, ny,
+                                       blocked_ids.data(), blocked_val.data());
+  int64_t differ = 0;
+  for (int64_t i = 0; i < nx; i++) {
+    const uint8_t *x_i = x.data() + i * dim;
+    CHECK(blocked_val[i] == (L2sqr<const uint8_t, const float, uint32_t>(
+                                x_i, y.data() + blocked_ids[i] * dim, dim)));
+    if (blocked_ids[i] != elkan_ids[i]) {
+      // the distances reported with integer precision can not order close
+      // centroids, compare them exactly
+      std::vector<float> xf(x_i, x_i + dim);
+      float tol = 4 * dim * std::numeric_limits<float>::epsilon() *
+                  (norm(xf.data()) + max_norm);
+      CHECK(exact_L2(x_i, y.data() + blocked_ids[i] * dim) <=
+            exact_L2(x_i, y.data() + elkan_ids[i] * dim) + tol);
+      differ++;
+    }
+  }
+  CHECK(differ * 100 < nx);
+
+  printf("test_kmeans_assign passed\n");
+  return 0;
+}